@@ -1,10 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "mpi.h"
 
+#include "perfcount.h"
+#include "mandel_kernel.h"
+#include "mandel_rect.h"
+#include "mandel_steal.h"
+
 /* Shorthand for less typing */
 typedef unsigned char uchar;
 
@@ -18,7 +28,11 @@ double serialTimeStopp;
 
 /* Declarations of output functions */
 void output();
+void colourImage(const void *src, uchar *buffer);
+void colourRow(const void *src, long first, uchar *row);
 void fancycolour(uchar *p, int iter);
+void bmpHeader(uchar *header, int x, int y);
+void writeBmpHeader(FILE *f, int x, int y);
 void savebmp(char *name, uchar *buffer, int x, int y);
 
 /* Struct for complex numbers */
@@ -49,8 +63,100 @@ double yupper, ylower;
 /* Distance between numbers */
 double step;
 
-/* Global array for iteration counts/pixels */
-int* pixel;
+/* Iteration counts/pixels. The entire image on rank 0, workers only keep
+ * the part they are working on. Stored in the smallest unsigned type that
+ * holds MAXITER, see pixelSize */
+void* pixel;
+
+/* Index of the first pixel held in pixel on rank 0, not 0 when the image
+ * is streamed to disk one band of rows at a time */
+long pixelBase = 0;
+
+/* Rows per band when streaming (-b), 0 keeps the whole image on rank 0 */
+int bandRows = 0;
+
+/* Every rank colours its own pixels and writes them into mandel2.bmp with
+ * MPI-IO (-w), instead of sending them to rank 0 */
+int parallelWrite = 0;
+MPI_File imageFile;
+
+/* Bytes per stored iteration count (1, 2 or 4) and the matching MPI type */
+int pixelSize = 4;
+MPI_Datatype pixelType;
+
+/* Run length encode results before sending them to rank 0 */
+int compressResults = 0;
+
+/* Result bytes this rank sent, and what they would have been uncompressed */
+double sentBytes = 0, rawBytes = 0;
+
+/* Work distribution: static equal ranges, dynamic row chunks, or rows
+ * partitioned by the cost of a low resolution preview */
+enum { SCHEDULE_STATIC, SCHEDULE_DYNAMIC, SCHEDULE_PREVIEW } schedule = SCHEDULE_STATIC;
+
+/* Rows handed out per request in the dynamic schedule */
+int chunkRows = 16;
+
+/* The preview samples every previewFactor'th pixel in both directions */
+int previewFactor = 4;
+
+/* Predicted max/avg work per rank from the preview, 0 when not used */
+double predictedImbalance = 0;
+
+/* Time this rank spent in calculate */
+double computeTime = 0;
+
+/* Escape time kernel chosen at startup with -k, and a row of its results */
+const char *kernelName = "auto";
+mandel_span_fn kernel;
+mandel_params_t kernelParams = { .cull = 1, .period_eps = 1e-12 };
+mandel_stats_t kernelStats;
+int *kernelRow;
+
+/* Smallest rectangle side for Mariani-Silver subdivision (-m), 0 is off */
+int subdivideSize = 0;
+
+/* Zoom animation (-a): frames rendered in one run, the width shrinking by
+ * animZoom per frame around a point that stays put in the image */
+int animFrames = 0;
+double animZoom = 0.9;
+double animTargetRe = -0.743643887037151, animTargetIm = 0.131825904205330;
+
+/* Frames go to frame<n>.bmp, or as a PPM stream into this file (-s) */
+const char *sinkPath = NULL;
+
+/* Images computed in this run, for the per pixel statistics */
+int frames = 1;
+
+/* Edge anti-aliasing (-A): pixels whose count differs from a 4-neighbour
+ * by more than aaThreshold are resampled on a rotated grid and the colours
+ * averaged. -1 is off */
+int aaThreshold = -1;
+#define AA_SAMPLES 4
+const double aaOffset[AA_SAMPLES][2] = {
+  { 0.125, 0.375 }, { 0.375, -0.125 }, { -0.125, -0.375 }, { -0.375, 0.125 }
+};
+
+/* The edge pixels found on rank 0, and their averaged colours there */
+int edgeCount = 0;
+int *edgeIndex;
+uchar *edgeColour;
+
+/* Work stealing threads per rank (-t), and the tiles they took from each
+ * other */
+int threads = 1;
+long stolenTiles = 0, stealTiles = 0;
+
+/* Rows [mirrorLo, mirrorHi) are the mirror image of rows mirrorSum - j
+ * across the real axis and are not computed, see mandel_mirror_rows. The
+ * ranks share the computeRows other rows, numbered without the gap, and
+ * rank 0 unfolds them after collecting. -S turns it off */
+int symmetry = 1;
+int mirrorSum = -1, mirrorLo = 0, mirrorHi = 0;
+int computeRows;
+
+/* Counters around calculate, only active when built with PERF=1 */
+perf_region_t calculate_perf = PERF_REGION_INIT("calculate");
 
 
 /* Only for serial timings */
@@ -60,45 +166,954 @@ double walltime() {
     return (t.tv_sec + 1e-6 * t.tv_usec);
 }
 
-/* Calculate the number of iterations until divergence for each pixel.
+/* Pixel size and vertical range from xleft, xright and ycenter, keeping
+ * the aspect ratio of the image */
+void setView() {
+  step = (xright - xleft)/XSIZE;
+  yupper = ycenter + (step * YSIZE)/2;
+  ylower = ycenter - (step * YSIZE)/2;
+}
+
+/* Image row of computed row r */
+int imageRow(int r) {
+  return r < mirrorLo ? r : r - mirrorLo + mirrorHi;
+}
+
+/* Choose the pixel storage from MAXITER */
+void choosePixelType() {
+  if (MAXITER <= UINT8_MAX) {
+    pixelSize = 1;
+    pixelType = MPI_UINT8_T;
+  } else if (MAXITER <= UINT16_MAX) {
+    pixelSize = 2;
+    pixelType = MPI_UINT16_T;
+  } else {
+    pixelSize = 4;
+    pixelType = MPI_INT;
+  }
+}
+
+int getPixel(const void *buf, long i) {
+  switch (pixelSize) {
+    case 1: return ((const uint8_t*) buf)[i];
+    case 2: return ((const uint16_t*) buf)[i];
+    default: return ((const int*) buf)[i];
+  }
+}
+
+void setPixel(void *buf, long i, int iter) {
+  switch (pixelSize) {
+    case 1: ((uint8_t*) buf)[i] = iter; break;
+    case 2: ((uint16_t*) buf)[i] = iter; break;
+    default: ((int*) buf)[i] = iter; break;
+  }
+}
+
+/* Address of pixel i in buf */
+void* pixelAt(void *buf, long i) {
+  return (char*) buf + i * pixelSize;
+}
+
+/* Run length encoding of count pixels: each run is the value in pixelSize
+ * bytes followed by its length as a base 128 varint. Returns the encoded
+ * size, or -1 if it would not be smaller than the raw pixels.
+ */
+int encodeRuns(const void *src, int count, uchar *out) {
+  int raw = count * pixelSize;
+  int n = 0;
+  for (int i = 0; i < count; ) {
+    int value = getPixel(src, i);
+    int run = 1;
+    while (i + run < count && getPixel(src, i + run) == value) {
+      run++;
+    }
+    if (n + pixelSize + 5 >= raw) {
+      return -1;
+    }
+    memcpy(&out[n], (const char*) src + (long) i * pixelSize, pixelSize);
+    n += pixelSize;
+    for (unsigned int r = run; ; r >>= 7) {
+      out[n++] = (r & 127) | (r > 127 ? 128 : 0);
+      if (r <= 127) {
+        break;
+      }
+    }
+    i += run;
+  }
+  return n;
+}
+
+void decodeRuns(const uchar *in, void *dst, int count) {
+  int n = 0;
+  for (int i = 0; i < count; ) {
+    const uchar *value = &in[n];
+    n += pixelSize;
+    unsigned int run = 0;
+    for (int shift = 0; ; shift += 7) {
+      uchar b = in[n++];
+      run |= (unsigned int)(b & 127) << shift;
+      if (!(b & 128)) {
+        break;
+      }
+    }
+    for (unsigned int r = 0; r < run; r++, i++) {
+      memcpy((char*) dst + (long) i * pixelSize, value, pixelSize);
+    }
+  }
+}
+
+/* Send count pixels to rank 0. The message tag is tag*2, plus one when
+ * the payload is run length encoded into scratch, which must hold
+ * count*pixelSize bytes and live until the request completes.
+ */
+void sendPixels(void *src, int count, int tag, uchar *scratch, MPI_Request *request) {
+  int n = compressResults ? encodeRuns(src, count, scratch) : -1;
+  rawBytes += (double) count * pixelSize;
+  if (n >= 0) {
+    sentBytes += n;
+    MPI_Isend(scratch, n, MPI_BYTE, 0, tag*2 + 1, MPI_COMM_WORLD, request);
+  } else {
+    sentBytes += (double) count * pixelSize;
+    MPI_Isend(src, count, pixelType, 0, tag*2, MPI_COMM_WORLD, request);
+  }
+}
+
+/* Receive a message found by MPI_Probe into count pixels at dst */
+void recvPixels(void *dst, int count, MPI_Status *status) {
+  if (status->MPI_TAG & 1) {
+    int n;
+    MPI_Get_count(status, MPI_BYTE, &n);
+    uchar *in = malloc(n);
+    MPI_Recv(in, n, MPI_BYTE, status->MPI_SOURCE, status->MPI_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    decodeRuns(in, dst, count);
+    free(in);
+  } else {
+    MPI_Recv(dst, count, pixelType, status->MPI_SOURCE, status->MPI_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  }
+}
+
+/* Total iterations spent on a range of pixels, each costs about 8 flops */
+double count_iterations(void *dst, int amount) {
+  double sum = 0;
+  for (int i = 0; i < amount; i++) {
+      sum += getPixel(dst, i);
+  }
+  return sum;
+}
+
+/* Number of iterations until divergence for one point.
  * If divergence never happens, return MAXITER
  */
-void calculate(int start, int amount) {
-  for (int i = start; i < start+amount; i++) {
-      complex_t c, z, temp;
-      int iter = 0;
-      c.real = (xleft + step * (i%XSIZE));
-      c.imag = (ylower + step * (i/XSIZE));
-      z = c;
-      while (z.real * z.real + z.imag * z.imag < 4) {
-        temp.real = z.real * z.real - z.imag * z.imag + c.real;
-        temp.imag = 2 * z.real * z.imag + c.imag;
-        z = temp;
-        iter++;
-        if(iter == MAXITER){
-            break;
-        }
+int iterate(complex_t c) {
+  complex_t z, temp;
+  int iter = 0;
+  z = c;
+  while (z.real * z.real + z.imag * z.imag < 4) {
+    temp.real = z.real * z.real - z.imag * z.imag + c.real;
+    temp.imag = 2 * z.real * z.imag + c.imag;
+    z = temp;
+    iter++;
+    if(iter == MAXITER){
+        break;
+    }
+  }
+  return iter;
+}
+
+/* Runs the kernel on pixels [from, to), a piece of one row at a time,
+ * storing pixel i at dst[i-start]
+ */
+void calculatePieces(void *dst, int start, int from, int to) {
+  for (int i = from; i < to; ) {
+      int row = i / XSIZE, col = i % XSIZE;
+      int n = XSIZE - col < to - i ? XSIZE - col : to - i;
+      kernel(&kernelParams, &kernelStats, xleft, step, ylower + step * imageRow(row), col, n, kernelRow);
+      for (int k = 0; k < n; k++) {
+          setPixel(dst, i - start + k, kernelRow[k]);
       }
-      pixel[i] = iter;
+      i += n;
   }
 }
 
-/*Perform parallel planning*/
-void planCalculation(int rank, int comm_sz){
-    int amountOfPixels = XSIZE*YSIZE;
-    int loadPerProcess = amountOfPixels/comm_sz;
-    
-    if (rank !=0) {
-        calculate((loadPerProcess*rank), loadPerProcess);
-        MPI_Send(&pixel[loadPerProcess*rank], loadPerProcess, MPI_INT, 0, 0, MPI_COMM_WORLD);
-   
+/* As calculatePieces, with the whole rows in between shared over the
+ * work stealing threads when there are several */
+void calculateSpans(void *dst, int start, int from, int to) {
+  int r0 = (from + XSIZE - 1) / XSIZE, r1 = to / XSIZE;
+  if (threads == 1 || r1 <= r0) {
+      calculatePieces(dst, start, from, to);
+      return;
+  }
+  calculatePieces(dst, start, from, r0 * XSIZE);
+  double *ci = malloc(sizeof(double) * (r1 - r0));
+  int *band = malloc(sizeof(int) * (r1 - r0) * XSIZE);
+  for (int r = r0; r < r1; r++) {
+      ci[r - r0] = ylower + step * imageRow(r);
+  }
+  stolenTiles += mandel_steal_render(kernel, &kernelParams, &kernelStats, threads, xleft, step,
+                                     ci, r1 - r0, XSIZE, band);
+  stealTiles += (long) ((XSIZE + MANDEL_TILE_W - 1) / MANDEL_TILE_W) *
+                ((r1 - r0 + MANDEL_TILE_H - 1) / MANDEL_TILE_H);
+  for (long k = 0; k < (long) (r1 - r0) * XSIZE; k++) {
+      setPixel(dst, r0 * XSIZE - start + k, band[k]);
+  }
+  free(ci);
+  free(band);
+  calculatePieces(dst, start, r1 * XSIZE, to);
+}
+
+/* Calculate the number of iterations until divergence for each pixel
+ * in [start, start+amount), stored from dst[0].
+ * If divergence never happens, return MAXITER
+ */
+void calculate(void *dst, int start, int amount) {
+  double t = MPI_Wtime();
+  perf_region_start(&calculate_perf);
+  double skipped = kernelStats.skipped;
+  int i = start;
+  /* With -m the whole rows of the range are subdivided as one band */
+  if (subdivideSize > 0) {
+      int r0 = (start + XSIZE - 1) / XSIZE, r1 = (start + amount) / XSIZE;
+      if (r1 > r0) {
+          calculateSpans(dst, start, start, r0 * XSIZE);
+          int *band = malloc(sizeof(int) * (r1 - r0) * XSIZE);
+          /* Either side of the mirrored rows on its own, the image rows
+           * of a subdivided rectangle must be adjacent */
+          for (int r = r0; r < r1; ) {
+              int end = r < mirrorLo && r1 > mirrorLo ? mirrorLo : r1;
+              mandel_subdivide(kernel, &kernelParams, &kernelStats, xleft, ylower, step,
+                               XSIZE, imageRow(r), imageRow(r) + end - r,
+                               &band[(long) (r - r0) * XSIZE], subdivideSize);
+              r = end;
+          }
+          for (long k = 0; k < (long) (r1 - r0) * XSIZE; k++) {
+              setPixel(dst, r0 * XSIZE - start + k, band[k]);
+          }
+          free(band);
+          i = r1 * XSIZE;
+      }
+  }
+  calculateSpans(dst, start, i, start + amount);
+  /* Culled, periodic and filled pixels hold counts they never iterated */
+  skipped = kernelStats.skipped - skipped;
+  perf_region_stop(&calculate_perf, 4.0 * amount,
+                   8.0 * (count_iterations(dst, amount) - skipped));
+  computeTime += MPI_Wtime() - t;
+}
+
+/* Colours pixels [first, first+count), held from src[0], and writes them
+ * at their place in imageFile. The rows of a bmp file are bottom up, so a
+ * range is at most three runs of bytes in the file: the end of its last
+ * row, the rows in between with their padding, and the start of its first
+ * row. Collectively these are one file view and MPI_File_write_at_all,
+ * otherwise MPI_File_write_at per run.
+ *
+ * A rank's part can pass 2^31 bytes. The view therefore counts whole
+ * padded rows as one element each and only the rest in bytes, and the
+ * independent writes go in pieces of at most INT_MAX bytes.
+ */
+void writePixels(const void *src, long first, long count, int collective){
+    MPI_Offset rowBytes = ((MPI_Offset) XSIZE * 3 + 3) & ~(MPI_Offset) 3;
+    uchar *buffer = calloc(3 * count + 4 * (count / XSIZE + 2), 1);
+    MPI_Offset disp[3], len[3];
+    int blocks = 0;
+    MPI_Offset n = 0;
+    long end = first + count;
+    for (long row = (end - 1) / XSIZE; count > 0 && row >= first / XSIZE; row--) {
+        long a = row * XSIZE > first ? row * XSIZE : first;
+        long b = (row + 1) * XSIZE < end ? (row + 1) * XSIZE : end;
+        MPI_Offset offset = 54 + (MPI_Offset) (YSIZE - 1 - row) * rowBytes + (MPI_Offset) 3 * (a - row * XSIZE);
+        MPI_Offset bytes = (MPI_Offset) 3 * (b - a) + (b == (row + 1) * XSIZE ? rowBytes - 3 * (MPI_Offset) XSIZE : 0);
+        for (long i = a; i < b; i++) {
+            fancycolour(buffer + n + 3 * (i - a), getPixel(src, i - first));
+        }
+        if (blocks > 0 && disp[blocks-1] + len[blocks-1] == offset) {
+            len[blocks-1] += bytes;
+        } else {
+            disp[blocks] = offset;
+            len[blocks] = bytes;
+            blocks++;
+        }
+        n += bytes;
+    }
+
+    if (collective) {
+        /* Each run as whole rows followed by the bytes left over, the same
+         * elements placed in the file and packed one after another in buffer */
+        MPI_Datatype row, view, packed;
+        MPI_Type_contiguous((int) rowBytes, MPI_BYTE, &row);
+        int parts = 0, partLen[6];
+        MPI_Aint fileDisp[6], bufferDisp[6];
+        MPI_Datatype partType[6];
+        MPI_Offset at = 0;
+        for (int k = 0; k < blocks; at += len[k], k++) {
+            MPI_Offset rows = len[k] / rowBytes, rest = len[k] % rowBytes;
+            if (rows > 0) {
+                partLen[parts] = (int) rows;
+                partType[parts] = row;
+                fileDisp[parts] = disp[k];
+                bufferDisp[parts] = at;
+                parts++;
+            }
+            if (rest > 0) {
+                partLen[parts] = (int) rest;
+                partType[parts] = MPI_BYTE;
+                fileDisp[parts] = disp[k] + rows * rowBytes;
+                bufferDisp[parts] = at + rows * rowBytes;
+                parts++;
+            }
+        }
+        MPI_Type_create_struct(parts, partLen, fileDisp, partType, &view);
+        MPI_Type_create_struct(parts, partLen, bufferDisp, partType, &packed);
+        MPI_Type_commit(&view);
+        MPI_Type_commit(&packed);
+        MPI_File_set_view(imageFile, 0, MPI_BYTE, view, "native", MPI_INFO_NULL);
+        MPI_File_write_at_all(imageFile, 0, buffer, parts > 0 ? 1 : 0, packed, MPI_STATUS_IGNORE);
+        MPI_File_set_view(imageFile, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+        MPI_Type_free(&view);
+        MPI_Type_free(&packed);
+        MPI_Type_free(&row);
     } else {
+        MPI_Offset at = 0;
+        for (int k = 0; k < blocks; at += len[k], k++) {
+            for (MPI_Offset done = 0; done < len[k]; ) {
+                int piece = len[k] - done < INT_MAX ? (int) (len[k] - done) : INT_MAX;
+                MPI_File_write_at(imageFile, disp[k] + done, buffer + at + done, piece, MPI_BYTE, MPI_STATUS_IGNORE);
+                done += piece;
+            }
+        }
+    }
+    free(buffer);
+}
+
+/* Every rank computes pixels [first[rank], first[rank]+count[rank]) and
+ * rank 0 assembles them into the full image, or with -w every rank writes
+ * its part of the file.
+ */
+void computeAndCollect(int rank, int comm_sz, const int *first, const int *count){
+    if (parallelWrite) {
+        void *part = malloc((size_t) pixelSize * count[rank] + 1);
+        calculate(part, first[rank], count[rank]);
+        writePixels(part, first[rank], count[rank], 1);
+        free(part);
+
+    } else if (rank != 0) {
+        pixel = malloc((size_t) pixelSize * count[rank]);
+        uchar *scratch = compressResults ? malloc((size_t) pixelSize * count[rank]) : NULL;
+        MPI_Request request;
+        calculate(pixel, first[rank], count[rank]);
+        sendPixels(pixel, count[rank], 0, scratch, &request);
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        free(scratch);
+
+    } else if (!compressResults) {
+        /* Post all receives first so rank 0 computes its own part while
+         * the workers' results come in */
+        MPI_Request *requests = malloc(comm_sz * sizeof(MPI_Request));
         for(int i = 1; i<comm_sz; i++){            
-             MPI_Recv(&pixel[loadPerProcess*i], loadPerProcess, MPI_INT, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+             MPI_Irecv(pixelAt(pixel, first[i] - pixelBase), count[i], pixelType, i, 0, MPI_COMM_WORLD, &requests[i-1]);
         }
  
-        calculate(0, loadPerProcess);
+        calculate(pixelAt(pixel, first[0] - pixelBase), first[0], count[0]);
+        MPI_Waitall(comm_sz-1, requests, MPI_STATUSES_IGNORE);
+        free(requests);
+
+    } else {
+        /* Encoded sizes are only known from the message itself. Probing
+         * one rank at a time keeps its messages in order when it has
+         * already sent its part of the next band */
+        calculate(pixelAt(pixel, first[0] - pixelBase), first[0], count[0]);
+        for (int i = 1; i < comm_sz; i++) {
+            MPI_Status status;
+            MPI_Probe(i, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            recvPixels(pixelAt(pixel, first[i] - pixelBase), count[i], &status);
+        }
+    }
+}
+
+/*Perform parallel planning, equal pixel ranges*/
+void staticCalculation(int rank, int comm_sz){
+    int loadPerProcess = XSIZE*computeRows/comm_sz;
+    int *first = malloc(comm_sz * sizeof(int));
+    int *count = malloc(comm_sz * sizeof(int));
+
+    /* The last rank takes the remainder */
+    for (int i = 0; i < comm_sz; i++) {
+        first[i] = loadPerProcess*i;
+        count[i] = i == comm_sz-1 ? XSIZE*computeRows - first[i] : loadPerProcess;
+    }
+    computeAndCollect(rank, comm_sz, first, count);
+    free(first);
+    free(count);
+}
+
+/* Receive every chunk that has already arrived, returns rows received */
+int drainChunks(int block) {
+    int rows = 0;
+    int flag = 1;
+    MPI_Status status;
+    while (1) {
+        if (block) {
+            MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        } else {
+            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+            if (!flag) {
+                break;
+            }
+        }
+        int row = status.MPI_TAG / 2 * chunkRows;
+        int count = row + chunkRows <= computeRows ? chunkRows : computeRows - row;
+        recvPixels(pixelAt(pixel, (long) row*XSIZE), count*XSIZE, &status);
+        rows += count;
+        if (block) {
+            break;
+        }
+    }
+    return rows;
+}
+
+/* Outstanding chunks a worker can have in flight before it waits */
+#define SEND_SLOTS 4
+
+/* Perform parallel planning, self scheduled row chunks.
+ * Every rank, including 0, takes the next chunk from a shared counter
+ * on rank 0 (MPI_Fetch_and_op on an RMA window) until the image is done.
+ * Workers send each finished chunk to rank 0 without waiting for it,
+ * tagged with the chunk number, from a small ring of chunk buffers.
+ * Rank 0 picks up results between its own chunks.
+ */
+void dynamicCalculation(int rank, int comm_sz){
+    int *counter;
+    MPI_Win win;
+    MPI_Win_allocate(rank == 0 ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL,
+                     MPI_COMM_WORLD, &counter, &win);
+    if (rank == 0) {
+        *counter = 0;
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    MPI_Win_lock_all(0, win);
+
+    MPI_Request requests[SEND_SLOTS];
+    uchar *scratch = NULL;
+    void *written = NULL;
+    int slot = 0;
+    int rowsDone = 0;
+    size_t chunkBytes = (size_t) pixelSize * chunkRows * XSIZE;
+    if (rank != 0) {
+        pixel = malloc(SEND_SLOTS * chunkBytes);
+        if (compressResults) {
+            scratch = malloc(SEND_SLOTS * chunkBytes);
+        }
+        for (int i = 0; i < SEND_SLOTS; i++) {
+            requests[i] = MPI_REQUEST_NULL;
+        }
+    }
+    if (parallelWrite) {
+        written = malloc(chunkBytes);
+    }
+
+    while (1) {
+        int row;
+        MPI_Fetch_and_op(&chunkRows, &row, MPI_INT, 0, 0, MPI_SUM, win);
+        MPI_Win_flush(0, win);
+        if (row >= computeRows) {
+            break;
+        }
+        int rows = row + chunkRows <= computeRows ? chunkRows : computeRows - row;
+
+        if (parallelWrite) {
+            /* Whole rows, written straight to the file */
+            calculate(written, row*XSIZE, rows*XSIZE);
+            writePixels(written, (long) row*XSIZE, (long) rows*XSIZE, 0);
+        } else if (rank != 0) {
+            /* Reuse the oldest buffer once its send has completed */
+            void *chunk = (char*) pixel + slot * chunkBytes;
+            MPI_Wait(&requests[slot], MPI_STATUS_IGNORE);
+            calculate(chunk, row*XSIZE, rows*XSIZE);
+            sendPixels(chunk, rows*XSIZE, row / chunkRows,
+                       scratch ? scratch + slot * chunkBytes : NULL, &requests[slot]);
+            slot = (slot + 1) % SEND_SLOTS;
+        } else {
+            calculate(pixelAt(pixel, (long) row*XSIZE), row*XSIZE, rows*XSIZE);
+            rowsDone += rows + drainChunks(0);
+        }
+    }
+
+    if (rank != 0) {
+        MPI_Waitall(SEND_SLOTS, requests, MPI_STATUSES_IGNORE);
+    } else if (!parallelWrite) {
+        while (rowsDone < computeRows) {
+            rowsDone += drainChunks(1);
+        }
+    }
+    free(scratch);
+    free(written);
+
+    MPI_Win_unlock_all(win);
+    MPI_Win_free(&win);
+}
+
+/* Split the rows so every rank gets the same share of the predicted cost,
+ * given as a prefix sum over the computed rows (computeRows+1 entries). rowStart must
+ * hold comm_sz+1 entries, rank r gets rows [rowStart[r], rowStart[r+1]).
+ */
+void partitionRows(int comm_sz, const double *prefix, int *rowStart){
+    /* Rank r starts at the first row where the prefix reaches r/comm_sz */
+    double total = prefix[computeRows];
+    double maxWork = 0;
+    int y = 0;
+    rowStart[0] = 0;
+    for (int r = 1; r < comm_sz; r++) {
+        double target = total * r / comm_sz;
+        while (y < computeRows && prefix[y+1] <= target) {
+            y++;
+        }
+        rowStart[r] = y;
+    }
+    rowStart[comm_sz] = computeRows;
+    for (int r = 0; r < comm_sz; r++) {
+        double work = prefix[rowStart[r+1]] - prefix[rowStart[r]];
+        if (work > maxWork) {
+            maxWork = work;
+        }
     }
+    predictedImbalance = maxWork / (total / comm_sz);
+}
+
+/* Row partition from the cost of a preview sampling every
+ * previewFactor'th pixel in both directions. Every rank computes the same
+ * preview, so no messages are needed to agree on the partition.
+ */
+void previewPartition(int comm_sz, int *rowStart){
+    int px = (XSIZE + previewFactor - 1) / previewFactor;
+    int py = (computeRows + previewFactor - 1) / previewFactor;
+
+    /* Cost of every full resolution row, prefix summed */
+    double *prefix = malloc((computeRows + 1) * sizeof(double));
+    double *previewRow = malloc(py * sizeof(double));
+    for (int j = 0; j < py; j++) {
+        previewRow[j] = 0;
+        for (int i = 0; i < px; i++) {
+            complex_t c;
+            c.real = xleft + step * (i * previewFactor);
+            c.imag = ylower + step * imageRow(j * previewFactor);
+            /* +1 so rows outside the set still count for something */
+            if (kernelParams.cull && mandel_culled(c.real, c.imag)) {
+                previewRow[j] += 1;
+            } else {
+                previewRow[j] += iterate(c) + 1;
+            }
+        }
+    }
+    prefix[0] = 0;
+    for (int y = 0; y < computeRows; y++) {
+        prefix[y+1] = prefix[y] + previewRow[y / previewFactor];
+    }
+    partitionRows(comm_sz, prefix, rowStart);
+
+    free(prefix);
+    free(previewRow);
+}
+
+/* Perform parallel planning, rank r computes rows [rowStart[r], rowStart[r+1]) */
+void rowCalculation(int rank, int comm_sz, const int *rowStart){
+    int *first = malloc(comm_sz * sizeof(int));
+    int *count = malloc(comm_sz * sizeof(int));
+    for (int i = 0; i < comm_sz; i++) {
+        first[i] = rowStart[i]*XSIZE;
+        count[i] = (rowStart[i+1] - rowStart[i])*XSIZE;
+    }
+    computeAndCollect(rank, comm_sz, first, count);
+    free(first);
+    free(count);
+}
+
+/* Perform parallel planning, rows partitioned by the preview cost model */
+void previewCalculation(int rank, int comm_sz){
+    int *rowStart = malloc((comm_sz + 1) * sizeof(int));
+    previewPartition(comm_sz, rowStart);
+    rowCalculation(rank, comm_sz, rowStart);
+    free(rowStart);
+}
+
+/* Computes the image one band of bandRows rows at a time, each split in
+ * equal row ranges over the ranks, and rank 0 colours every band and
+ * appends it to mandel2.bmp. Bands go from the last row to the first, in
+ * the bottom up order of the file, so memory stays O(band) on every rank.
+ */
+void streamCalculation(int rank, int comm_sz, int write){
+    FILE *f = NULL;
+    uchar *row = NULL;
+    size_t rowBytes = ((size_t) XSIZE * 3 + 3) & ~(size_t) 3;
+    if (rank == 0) {
+        pixel = malloc((size_t) pixelSize * bandRows * XSIZE);
+        row = malloc(rowBytes);
+        if (write) {
+            f = fopen("mandel2.bmp", "wb");
+            if (!f) {
+                printf("Error writing image to disk.\n");
+            } else {
+                writeBmpHeader(f, XSIZE, YSIZE);
+            }
+        }
+    }
+
+    int *first = malloc(comm_sz * sizeof(int));
+    int *count = malloc(comm_sz * sizeof(int));
+    for (int y1 = YSIZE; y1 > 0; y1 -= bandRows) {
+        int y0 = y1 - bandRows > 0 ? y1 - bandRows : 0;
+        for (int i = 0; i < comm_sz; i++) {
+            first[i] = (y0 + (y1 - y0) * i / comm_sz) * XSIZE;
+            count[i] = (y0 + (y1 - y0) * (i + 1) / comm_sz) * XSIZE - first[i];
+        }
+        pixelBase = (long) y0 * XSIZE;
+        computeAndCollect(rank, comm_sz, first, count);
+
+        if (rank != 0) {
+            free(pixel);
+            pixel = NULL;
+        } else if (f) {
+            for (int y = y1 - 1; y >= y0; y--) {
+                memset(row, 0, rowBytes);
+                colourRow(pixel, (long) (y - y0) * XSIZE, row);
+                fwrite(row, 1, rowBytes, f);
+            }
+        }
+    }
+    pixelBase = 0;
+
+    if (f) {
+        fclose(f);
+    }
+    free(row);
+    free(first);
+    free(count);
+}
+
+/* Moves the computed rows on rank 0 to their image rows and copies the
+ * mirrored rows from their counterparts */
+void unfoldMirror(){
+    size_t rowBytes = (size_t) pixelSize * XSIZE;
+    memmove(pixelAt(pixel, (long) mirrorHi * XSIZE), pixelAt(pixel, (long) mirrorLo * XSIZE),
+            rowBytes * (YSIZE - mirrorHi));
+    for (int j = mirrorLo; j < mirrorHi; j++) {
+        memcpy(pixelAt(pixel, (long) j * XSIZE), pixelAt(pixel, (long) (mirrorSum - j) * XSIZE), rowBytes);
+    }
+}
+
+/* Prints how evenly the calculation was spread, as max/avg compute time */
+void reportBalance(int rank, int comm_sz){
+    double *times = NULL;
+    if (rank == 0) {
+        times = malloc(comm_sz * sizeof(double));
+    }
+    MPI_Gather(&computeTime, 1, MPI_DOUBLE, times, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+        double max = 0, sum = 0;
+        for (int i = 0; i < comm_sz; i++) {
+            sum += times[i];
+            if (times[i] > max) {
+                max = times[i];
+            }
+        }
+        if (predictedImbalance > 0) {
+            printf("Predicted imbalance %.3f\n", predictedImbalance);
+        }
+        printf("Actual imbalance %.3f (compute max %f s, avg %f s)\n",
+               max / (sum / comm_sz), max, sum / comm_sz);
+        free(times);
+    }
+
+    long shortcut[3] = { kernelStats.culled, kernelStats.periodic, kernelStats.filled };
+    long shortcuts[3];
+    MPI_Reduce(shortcut, shortcuts, 3, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (rank == 0 && kernelParams.cull) {
+        printf("Culled %ld pixels inside the cardioid and bulb (%.1f%%)\n",
+               shortcuts[0], 100.0 * shortcuts[0] / ((double) XSIZE * YSIZE * frames));
+    }
+    if (rank == 0 && kernelParams.period_eps > 0) {
+        printf("Stopped %ld pixels on a periodic orbit (%.1f%%)\n",
+               shortcuts[1], 100.0 * shortcuts[1] / ((double) XSIZE * YSIZE * frames));
+    }
+    if (rank == 0 && subdivideSize > 0) {
+        printf("Filled %ld pixels inside uniform rectangles (%.1f%%)\n",
+               shortcuts[2], 100.0 * shortcuts[2] / ((double) XSIZE * YSIZE * frames));
+    }
+
+    long steals[2] = { stolenTiles, stealTiles }, stealTotal[2];
+    MPI_Reduce(steals, stealTotal, 2, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (rank == 0 && threads > 1) {
+        printf("%d threads per rank, %ld of %ld tiles of %dx%d stolen\n",
+               threads, stealTotal[0], stealTotal[1], MANDEL_TILE_W, MANDEL_TILE_H);
+    }
+
+    double bytes[2] = { sentBytes, rawBytes }, total[2];
+    MPI_Reduce(bytes, total, 2, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (rank == 0 && comm_sz > 1) {
+        printf("Result traffic %.2f MB (%d byte pixels, %.2f MB unencoded)\n",
+               total[0] * 1e-6, pixelSize, total[1] * 1e-6);
+    }
+}
+
+void planCalculation(int rank, int comm_sz){
+    if (schedule == SCHEDULE_DYNAMIC) {
+        dynamicCalculation(rank, comm_sz);
+    } else if (schedule == SCHEDULE_PREVIEW) {
+        previewCalculation(rank, comm_sz);
+    } else {
+        staticCalculation(rank, comm_sz);
+    }
+}
+
+/* Row cost prefix of the current view predicted from the previous frame's
+ * counts prev, whose view had its lower left corner at (pxleft, pylower)
+ * and pixels pstep wide. Samples like the preview, with every sample
+ * looked up in the previous frame instead of iterated.
+ */
+void predictFromFrame(const void *prev, double pxleft, double pylower, double pstep,
+                      double *prefix){
+    int py = (YSIZE + previewFactor - 1) / previewFactor;
+    double *previewRow = malloc(py * sizeof(double));
+    for (int j = 0; j < py; j++) {
+        long y = lround((ylower + step * (j * previewFactor) - pylower) / pstep);
+        y = y < 0 ? 0 : y >= YSIZE ? YSIZE - 1 : y;
+        previewRow[j] = 0;
+        for (int i = 0; i < XSIZE; i += previewFactor) {
+            long x = lround((xleft + step * i - pxleft) / pstep);
+            x = x < 0 ? 0 : x >= XSIZE ? XSIZE - 1 : x;
+            previewRow[j] += getPixel(prev, y * XSIZE + x) + 1;
+        }
+    }
+    prefix[0] = 0;
+    for (int y = 0; y < YSIZE; y++) {
+        prefix[y+1] = prefix[y] + previewRow[y / previewFactor];
+    }
+    free(previewRow);
+}
+
+/* A finished frame handed to the sink thread */
+typedef struct {
+    const void *src;
+    int index;
+    FILE *stream;
+} frame_job_t;
+
+/* Colours a frame and writes it out, while the ranks compute the next */
+void* frameSink(void *arg) {
+    const frame_job_t *job = arg;
+    uchar *buffer = calloc((size_t) XSIZE * YSIZE * 3, 1);
+    colourImage(job->src, buffer);
+    if (job->stream) {
+        /* PPM is top down RGB, the buffer bottom up BGR */
+        fprintf(job->stream, "P6\n%d %d\n255\n", XSIZE, YSIZE);
+        uchar *row = malloc((size_t) XSIZE * 3);
+        for (int j = YSIZE - 1; j >= 0; j--) {
+            const uchar *p = buffer + (size_t) j * XSIZE * 3;
+            for (int i = 0; i < XSIZE; i++) {
+                row[3*i] = p[3*i+2];
+                row[3*i+1] = p[3*i+1];
+                row[3*i+2] = p[3*i];
+            }
+            fwrite(row, 1, (size_t) XSIZE * 3, job->stream);
+        }
+        fflush(job->stream);
+        free(row);
+    } else {
+        char name[32];
+        sprintf(name, "frame%04d.bmp", job->index);
+        savebmp(name, buffer, XSIZE, YSIZE);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/* Renders animFrames frames zooming in on the animation target.
+ * From the second frame on the rows are partitioned by the previous
+ * frame's counts, resampled to the new view, so no preview is computed;
+ * the dynamic schedule balances itself and is kept as is. Rank 0 keeps
+ * two frame buffers, so the sink can write frame f while frame f+1 is
+ * computed and predicted from it.
+ */
+void animate(int rank, int comm_sz, int write){
+    void *frame[2] = { NULL, NULL };
+    double *prefix = malloc((YSIZE + 1) * sizeof(double));
+    int *rowStart = malloc((comm_sz + 1) * sizeof(int));
+    FILE *stream = NULL;
+    if (rank == 0) {
+        frame[0] = pixel;
+        frame[1] = malloc((size_t) pixelSize * XSIZE * YSIZE);
+        if (write && sinkPath) {
+            stream = fopen(sinkPath, "wb");
+            if (!stream) {
+                printf("Error opening %s, frames are not written.\n", sinkPath);
+                write = 0;
+            }
+        }
+    }
+
+    pthread_t sink;
+    frame_job_t job;
+    int sinking = 0;
+    double centreRe = (xleft + xright) / 2, centreIm = ycenter, width = xright - xleft;
+    double pxleft = 0, pylower = 0, pstep = 0;
+    frames = animFrames;
+
+    for (int f = 0; f < animFrames; f++) {
+        /* The target keeps its place in the image as the view shrinks */
+        double scale = pow(animZoom, f);
+        double re = animTargetRe + (centreRe - animTargetRe) * scale;
+        xleft = re - width * scale / 2;
+        xright = re + width * scale / 2;
+        ycenter = animTargetIm + (centreIm - animTargetIm) * scale;
+        setView();
+
+        double t = MPI_Wtime();
+        predictedImbalance = 0;
+        if (rank == 0) {
+            pixel = frame[f & 1];
+        }
+        if (f > 0 && schedule != SCHEDULE_DYNAMIC) {
+            if (rank == 0) {
+                predictFromFrame(frame[(f - 1) & 1], pxleft, pylower, pstep, prefix);
+            }
+            MPI_Bcast(prefix, YSIZE + 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+            partitionRows(comm_sz, prefix, rowStart);
+            rowCalculation(rank, comm_sz, rowStart);
+        } else {
+            planCalculation(rank, comm_sz);
+        }
+        pxleft = xleft;
+        pylower = ylower;
+        pstep = step;
+
+        if (rank != 0) {
+            free(pixel);
+            pixel = NULL;
+            continue;
+        }
+        if (predictedImbalance > 0) {
+            printf("Frame %d: width %g, %f s, predicted imbalance %.3f\n",
+                   f, xright - xleft, MPI_Wtime() - t, predictedImbalance);
+        } else {
+            printf("Frame %d: width %g, %f s\n", f, xright - xleft, MPI_Wtime() - t);
+        }
+        if (write) {
+            if (sinking) {
+                pthread_join(sink, NULL);
+            }
+            job = (frame_job_t){ frame[f & 1], f, stream };
+            pthread_create(&sink, NULL, frameSink, &job);
+            sinking = 1;
+        }
+    }
+
+    if (sinking) {
+        pthread_join(sink, NULL);
+    }
+    if (stream) {
+        fclose(stream);
+    }
+    if (rank == 0) {
+        free(frame[1]);
+        pixel = frame[0];
+    }
+    free(prefix);
+    free(rowStart);
+}
+
+/* Lists the pixels of the full image on rank 0 that differ from a
+ * 4-neighbour by more than aaThreshold */
+void findEdges(){
+    #define EDGE(x, y) (abs(getPixel(pixel, (long) (y) * XSIZE + (x)) - v) > aaThreshold)
+    for (int pass = 0; pass < 2; pass++) {
+        edgeCount = 0;
+        for (int y = 0; y < YSIZE; y++) {
+            for (int x = 0; x < XSIZE; x++) {
+                int v = getPixel(pixel, (long) y * XSIZE + x);
+                if ((x > 0 && EDGE(x-1, y)) || (x < XSIZE-1 && EDGE(x+1, y)) ||
+                    (y > 0 && EDGE(x, y-1)) || (y < YSIZE-1 && EDGE(x, y+1))) {
+                    if (pass == 1) {
+                        edgeIndex[edgeCount] = y * XSIZE + x;
+                    }
+                    edgeCount++;
+                }
+            }
+        }
+        if (pass == 0) {
+            edgeIndex = malloc((edgeCount + 1) * sizeof(int));
+        }
+    }
+    #undef EDGE
+}
+
+/* Supersamples the edge pixels. Rank 0 finds them and broadcasts the list,
+ * rank r takes every comm_sz'th pixel from r so the costly stretches of
+ * the boundary are shared, and the averaged colours are gathered back.
+ */
+void antialias(int rank, int comm_sz){
+    double t = MPI_Wtime();
+    if (rank == 0) {
+        findEdges();
+    }
+    MPI_Bcast(&edgeCount, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (rank != 0) {
+        edgeIndex = malloc((edgeCount + 1) * sizeof(int));
+    }
+    MPI_Bcast(edgeIndex, edgeCount, MPI_INT, 0, MPI_COMM_WORLD);
+
+    int mine = (edgeCount - rank + comm_sz - 1) / comm_sz;
+    uchar *colour = malloc(3 * mine + 1);
+    for (int k = 0; k < mine; k++) {
+        int i = edgeIndex[rank + k * comm_sz];
+        int x = i % XSIZE, y = i / XSIZE;
+        int sum[3] = { 0, 0, 0 };
+        for (int n = 0; n < AA_SAMPLES; n++) {
+            int iter;
+            uchar p[3] = { 0, 0, 0 };
+            mandel_span_scalar(&kernelParams, &kernelStats, xleft + step * (x + aaOffset[n][0]), 0,
+                               ylower + step * (y + aaOffset[n][1]), 0, 1, &iter);
+            fancycolour(p, iter);
+            for (int c = 0; c < 3; c++) {
+                sum[c] += p[c];
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            colour[3*k + c] = (sum[c] + AA_SAMPLES / 2) / AA_SAMPLES;
+        }
+    }
+
+    int *counts = NULL, *displs = NULL;
+    uchar *gathered = NULL;
+    if (rank == 0) {
+        counts = malloc(comm_sz * sizeof(int));
+        displs = malloc(comm_sz * sizeof(int));
+        for (int r = 0, offset = 0; r < comm_sz; r++) {
+            counts[r] = 3 * ((edgeCount - r + comm_sz - 1) / comm_sz);
+            displs[r] = offset;
+            offset += counts[r];
+        }
+        gathered = malloc(3 * edgeCount + 1);
+    }
+    MPI_Gatherv(colour, 3 * mine, MPI_BYTE, gathered, counts, displs, MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        /* Back from rank order to edge list order */
+        edgeColour = malloc(3 * edgeCount + 1);
+        for (int r = 0; r < comm_sz; r++) {
+            for (int k = 0; k < counts[r] / 3; k++) {
+                memcpy(&edgeColour[3 * (r + k * comm_sz)], &gathered[displs[r] + 3*k], 3);
+            }
+        }
+        printf("Anti-aliased %d edge pixels (%.1f%%) with %d samples in %f s\n",
+               edgeCount, 100.0 * edgeCount / ((double) XSIZE * YSIZE), AA_SAMPLES,
+               MPI_Wtime() - t);
+        free(counts);
+        free(displs);
+        free(gathered);
+    } else {
+        free(edgeIndex);
+        edgeCount = 0;
+    }
+    free(colour);
 }
 
 int main(int argc, char **argv) {
@@ -106,9 +1121,86 @@ int main(int argc, char **argv) {
     starttime = MPI_Wtime();
 
     /* Check input arguments */
-  if (argc == 1) {
-    puts("Usage: MANDEL n");
+  int opt;
+  while ((opt = getopt(argc, argv, "d:p:zk:ce:m:a:f:s:A:b:wSt:")) != -1) {
+    switch (opt) {
+      case 'd':
+        schedule = SCHEDULE_DYNAMIC;
+        chunkRows = strtol(optarg, NULL, 10);
+        break;
+      case 'p':
+        schedule = SCHEDULE_PREVIEW;
+        previewFactor = strtol(optarg, NULL, 10);
+        break;
+      case 'z':
+        compressResults = 1;
+        break;
+      case 'k':
+        kernelName = optarg;
+        break;
+      case 'c':
+        kernelParams.cull = 0;
+        break;
+      case 'e':
+        kernelParams.period_eps = strtod(optarg, NULL);
+        break;
+      case 'm':
+        subdivideSize = strtol(optarg, NULL, 10);
+        break;
+      case 'a':
+        animFrames = strtol(optarg, NULL, 10);
+        break;
+      case 'f':
+        animZoom = strtod(optarg, NULL);
+        break;
+      case 's':
+        sinkPath = optarg;
+        break;
+      case 'A':
+        aaThreshold = strtol(optarg, NULL, 10);
+        break;
+      case 'b':
+        bandRows = strtol(optarg, NULL, 10);
+        break;
+      case 'w':
+        parallelWrite = 1;
+        break;
+      case 'S':
+        symmetry = 0;
+        break;
+      case 't':
+        threads = strtol(optarg, NULL, 10);
+        break;
+      default:
+        return 0;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc == 1 || chunkRows < 1 || previewFactor < 1 || animFrames < 0 || animZoom <= 0 || threads < 1 ||
+      (threads > 1 && subdivideSize > 0) || (animFrames > 0 && aaThreshold >= 0) ||
+      bandRows < 0 || (bandRows > 0 && (animFrames > 0 || aaThreshold >= 0 || schedule != SCHEDULE_STATIC)) ||
+      (parallelWrite && (animFrames > 0 || aaThreshold >= 0 || bandRows > 0))) {
+    puts("Usage: MANDEL [-d rows | -p factor] [-z] [-k kernel] [-c] [-e eps] [-m size] [-a frames [-f zoom] [-s sink] | -A threshold | -b rows | -w] [-S] [-t threads] n [scale]");
     puts("n decides whether image should be written to disk (1 = yes, 0 = no)");
+    puts("scale multiplies image size and MAXITER");
+    puts("-d rows: dynamic scheduling, ranks take chunks of this many rows");
+    puts("-p factor: partition rows by the cost of a 1/factor^2 preview");
+    puts("-z: run length encode results sent to rank 0");
+    puts("-k kernel: auto, scalar, avx2 or avx512 (default auto)");
+    puts("-c: iterate points inside the cardioid and bulb instead of culling them");
+    puts("-e eps: periodicity check tolerance, 0 turns it off (default 1e-12)");
+    puts("-m size: fill rectangles with a uniform border, down to this side length");
+    puts("-a frames: render a zoom animation into seahorse valley, written to frame<n>.bmp");
+    puts("-f zoom: width of each frame relative to the one before (default 0.9)");
+    puts("-s sink: write the frames as a PPM stream into this file or pipe instead");
+    puts("-A threshold: supersample pixels whose count differs from a neighbour by more");
+    puts("-b rows: compute and write the image in bands of this many rows, not all at once,");
+    puts("   each band split evenly over the ranks, not with -d or -p");
+    puts("-w: every rank writes its own pixels into the image with MPI-IO");
+    puts("-S: compute both halves of a view centred on the real axis instead of mirroring");
+    puts("-t threads: share each rank's rows over threads with work stealing, not with -m");
     return 0;
   } else if ( argc == 3 ){
     scaleValue = strtol(argv[2], NULL, 10);
@@ -117,24 +1209,107 @@ int main(int argc, char **argv) {
      MAXITER *= scaleValue;
 
   }
+
+  /* Pick the escape time kernel once, before any work */
+  kernel = mandel_select(kernelName, &kernelName);
+  if (kernel == NULL) {
+    printf("Kernel %s is unknown or not supported by this CPU\n", kernelName);
+    return 0;
+  }
+  kernelParams.maxiter = MAXITER;
+  kernelRow = malloc(sizeof(int) * XSIZE);
     
     /*init and get basic MPI knowledge*/
     int     comm_sz;
     int     my_rank;
-    MPI_Init(NULL, NULL);
+    int     provided;
+    /* Worker threads (-t) and the animation sink run beside MPI, only
+     * the main thread calls it */
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_size(MPI_COMM_WORLD, &comm_sz);
     MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    if (provided < MPI_THREAD_FUNNELED) {
+      if (my_rank == 0) {
+        printf("MPI does not support threads (MPI_THREAD_FUNNELED)\n");
+      }
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
   
   /* Calculate the range in the y - axis such that we preserve the aspect ratio */
-  step = (xright - xleft)/XSIZE;
-  yupper = ycenter + (step * YSIZE)/2;
-  ylower = ycenter - (step * YSIZE)/2;
+  setView();
+
+  /* Mirror across the real axis when the whole image is collected on rank 0 */
+  computeRows = YSIZE;
+  if (symmetry && animFrames == 0 && bandRows == 0 && !parallelWrite) {
+    mirrorSum = mandel_mirror_rows(ylower, step, YSIZE, &mirrorLo, &mirrorHi);
+    computeRows = YSIZE - (mirrorHi - mirrorLo);
+  }
   
-  /* Allocate memory for the entire image */
-  pixel = (int*) malloc(sizeof(int) * XSIZE * YSIZE);
+  /* Dynamic chunks are sent with tag 2*chunk or 2*chunk + 1, and MPI only
+   * promises tags up to 32767 */
+  if (schedule == SCHEDULE_DYNAMIC) {
+    int *tagUpper, found;
+    MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tagUpper, &found);
+    long chunks = (computeRows + chunkRows - 1) / chunkRows;
+    if (found && 2 * chunks - 1 > *tagUpper) {
+      if (my_rank == 0) {
+        printf("-d %d makes %ld chunks, MPI tags only go up to %d: use at least %ld rows\n",
+               chunkRows, chunks, *tagUpper, (computeRows + (*tagUpper + 1) / 2 - 1) / ((*tagUpper + 1) / 2));
+      }
+      MPI_Finalize();
+      return 0;
+    }
+  }
+
+  /* With -w the file is opened by all ranks and rank 0 writes the header */
+  if (parallelWrite && strtol(argv[1], NULL, 10) == 0) {
+    parallelWrite = 0;
+  }
+  if (parallelWrite) {
+    MPI_Offset size = 54 + (((MPI_Offset) XSIZE * 3 + 3) & ~(MPI_Offset) 3) * YSIZE;
+    if (MPI_File_open(MPI_COMM_WORLD, "mandel2.bmp", MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                      MPI_INFO_NULL, &imageFile) != MPI_SUCCESS) {
+      if (my_rank == 0) {
+        printf("Error opening mandel2.bmp, collecting the image on rank 0 instead.\n");
+      }
+      parallelWrite = 0;
+    } else {
+      MPI_File_set_size(imageFile, size);
+      if (my_rank == 0) {
+        uchar header[54];
+        bmpHeader(header, XSIZE, YSIZE);
+        MPI_File_write_at(imageFile, 0, header, 54, MPI_BYTE, MPI_STATUS_IGNORE);
+      }
+    }
+  }
+
+  /* Allocate memory for the entire image, workers allocate their own part */
+  choosePixelType();
+  if (my_rank == 0 && bandRows == 0 && !parallelWrite) {
+    pixel = malloc((size_t) pixelSize * XSIZE * YSIZE);
+  }
 
   /* Perform calculation */
+  if (animFrames > 0) {
+    animate(my_rank, comm_sz, strtol(argv[1], NULL, 10) != 0);
+    reportBalance(my_rank, comm_sz);
+  } else if (bandRows > 0) {
+    streamCalculation(my_rank, comm_sz, strtol(argv[1], NULL, 10) != 0);
+    reportBalance(my_rank, comm_sz);
+  } else if (parallelWrite) {
     planCalculation(my_rank, comm_sz);
+    MPI_File_close(&imageFile);
+    reportBalance(my_rank, comm_sz);
+  } else {
+    planCalculation(my_rank, comm_sz);
+    if (my_rank == 0 && mirrorSum >= 0) {
+      unfoldMirror();
+      printf("Mirrored %d rows across the real axis\n", mirrorHi - mirrorLo);
+    }
+    reportBalance(my_rank, comm_sz);
+    if (aaThreshold >= 0) {
+      antialias(my_rank, comm_sz);
+    }
     
   /* Output */
     if ( my_rank == 0){
@@ -142,38 +1317,75 @@ int main(int argc, char **argv) {
       output();
       }
     }
+  }
   
   
   endtime   = MPI_Wtime();
   serialTimeStopp = walltime();
 
+  char perf_prefix[16];
+  sprintf(perf_prefix, "rank %d ", my_rank);
+  perf_region_report(&calculate_perf, perf_prefix);
+
   if (my_rank == 0){
+        printf("Kernel: %s\n", kernelName);
         printf("Parallel took %f seconds\n",endtime-starttime);
         printf("Serial took %f seconds\n",serialTimeStopp-serialTimeStart);
     }
 
+    free(pixel);
+    free(kernelRow);
+    if (edgeCount > 0) {
+      free(edgeIndex);
+      free(edgeColour);
+    }
     MPI_Finalize();
   return 0;
 }
 
-/* Save 24 - bits bmp file, buffer must be in bmp format: upside - down */
+/* The 54 byte header of a 24 - bits bmp file, x by y pixels */
+void bmpHeader(uchar *header, int x, int y) {
+  unsigned long rowBytes = ((unsigned long) x * 3 + 3) & ~3UL;
+  unsigned long size = rowBytes * y + 54;
+  /* Sizes past 4 GB do not fit, readers go by width and height then */
+  if (size > 0xffffffffUL) {
+    size = 0;
+  }
+  const uchar fields[54] = {'B', 'M',
+                            size&255,
+                            (size >> 8)&255,
+                            (size >> 16)&255,
+                            (size >> 24)&255,
+                            0, 0, 0, 0, 54, 0, 0, 0, 40, 0, 0, 0,
+                            x&255, (x >> 8)&255, (x >> 16)&255, (x >> 24)&255,
+                            y&255, (y >> 8)&255, (y >> 16)&255, (y >> 24)&255,
+                            1, 0, 24, 0, 0, 0, 0, 0, 0, 0,
+                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  memcpy(header, fields, 54);
+}
+
+/* Write the header of a 24 - bits bmp file, x by y pixels */
+void writeBmpHeader(FILE *f, int x, int y) {
+  uchar header[54];
+  bmpHeader(header, x, y);
+  fwrite(header, 1, 54, f);
+}
+
+/* Save 24 - bits bmp file, buffer must be in bmp format: upside - down.
+ * The buffer rows are x*3 bytes, in the file they are padded to 4 bytes */
 void savebmp(char *name, uchar *buffer, int x, int y) {
   FILE *f = fopen(name, "wb");
   if (!f) {
     printf("Error writing image to disk.\n");
     return;
   }
-  unsigned int size = x * y * 3 + 54;
-  uchar header[54] = {'B', 'M',
-                      size&255,
-                      (size >> 8)&255,
-                      (size >> 16)&255,
-                      size >> 24,
-                      0, 0, 0, 0, 54, 0, 0, 0, 40, 0, 0, 0, x&255, x >> 8, 0,
-                      0, y&255, y >> 8, 0, 0, 1, 0, 24, 0, 0, 0, 0, 0, 0, 0,
-                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-  fwrite(header, 1, 54, f);
-  fwrite(buffer, 1, XSIZE * YSIZE * 3, f);
+  writeBmpHeader(f, x, y);
+  const uchar pad[3] = { 0, 0, 0 };
+  size_t rowBytes = (size_t) x * 3;
+  for (int j = 0; j < y; j++) {
+    fwrite(buffer + rowBytes * j, 1, rowBytes, f);
+    fwrite(pad, 1, (4 - rowBytes % 4) % 4, f);
+  }
   fclose(f);
 }
 
@@ -186,14 +1398,28 @@ void fancycolour(uchar *p, int iter) {
   else { p[0] = p[1] = (iter - 160) * 2; p[2] = 255 - (iter - 160) * 2; }
 }
 
+/* Colour the iteration counts in src into buffer, upside down (bmp format) */
+void colourImage(const void *src, uchar *buffer){
+    for (int j = 0; j < YSIZE; j++) {
+      colourRow(src, (long) XSIZE * j, buffer + (long) (YSIZE - j - 1) * XSIZE * 3);
+    }
+}
+
+/* Colour the XSIZE counts from src[first] into row, which must be zeroed */
+void colourRow(const void *src, long first, uchar *row){
+    for (int i = 0; i < XSIZE; i++) {
+      fancycolour(row + 3 * i, getPixel(src, first + i));
+    }
+}
+
 /* Create nice image from iteration counts. take care to create it upside down (bmp format) */
 void output(){
     unsigned char *buffer = calloc(XSIZE * YSIZE * 3, 1);
-    for (int i = 0; i < XSIZE; i++) {
-      for (int j = 0; j < YSIZE; j++) {
-        int p = ((YSIZE - j - 1) * XSIZE + i) * 3;
-        fancycolour(buffer + p, pixel[(i + XSIZE * j)]);
-      }
+    colourImage(pixel, buffer);
+    /* Edge pixels take their supersampled colour */
+    for (int k = 0; k < edgeCount; k++) {
+      int x = edgeIndex[k] % XSIZE, y = edgeIndex[k] / XSIZE;
+      memcpy(buffer + ((long) (YSIZE - y - 1) * XSIZE + x) * 3, &edgeColour[3*k], 3);
     }
     /* write image to disk */
     savebmp("mandel2.bmp", buffer, XSIZE, YSIZE);
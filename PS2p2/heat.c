@@ -5,6 +5,8 @@
 
 #include <mpi.h>
 
+#include "perfcount.h"
+
 /* Functions to be implemented: */
 void ftcs_solver ( int step );
 void border_exchange ( int step );
@@ -104,6 +106,9 @@ MPI_Status stats[8];
 // Cartesian communicator
 MPI_Comm cart;
 
+// Counters around the stencil, only active when built with PERF=1
+perf_region_t ftcs_perf = PERF_REGION_INIT("ftcs_solver");
+
 
 // MPI datatypes for gather/scater/border exchange
 MPI_Datatype
@@ -285,7 +290,12 @@ int main ( int argc, char **argv ){
             external_heat ( step );
         }
         border_exchange( step );
+
+        // Per cell: read in and material, write out (12 bytes), 7 flops
+        perf_region_start(&ftcs_perf);
         ftcs_solver( step );
+        perf_region_stop(&ftcs_perf, 12.0*local_grid_size[0]*local_grid_size[1],
+                7.0*local_grid_size[0]*local_grid_size[1]);
 
         if((step % SNAPSHOT) == 0){
             gather_temp ( step );
@@ -303,6 +313,10 @@ int main ( int argc, char **argv ){
     free(local_temp[0]);
     free (local_temp[1]);
 
+    char perf_prefix[16];
+    sprintf(perf_prefix, "rank %d ", rank);
+    perf_region_report(&ftcs_perf, perf_prefix);
+
     MPI_Finalize();
     exit ( EXIT_SUCCESS );
 }
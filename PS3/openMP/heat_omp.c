@@ -5,6 +5,8 @@
 #include <omp.h>
 #include <pthread.h>
 
+#include "perfcount.h"
+
 
 /* Functions to be implemented: */
 void ftcs_solver ( int step );
@@ -73,6 +75,9 @@ const float
     
 int n_threads = 1;
 
+/* Counters around the stencil, only active when built with PERF=1 */
+perf_region_t ftcs_perf = PERF_REGION_INIT("ftcs_solver");
+
 
 
 
@@ -98,6 +103,12 @@ void ftcs_solver( int step ){
         int whatWeNeedToLoopThru = (GRID_SIZE[0]*GRID_SIZE[1]);
         int whatEachThreadCanTake = whatWeNeedToLoopThru/numberOfThreads;
         int start = whatEachThreadCanTake*thisThreadRank;
+
+        /* The master thread is already counted by perf_region_start */
+        perf_sample_t perf_sample;
+        if(thisThreadRank != 0){
+            perf_thread_start(&perf_sample);
+        }
         
         for (int i = start; i < (start+whatEachThreadCanTake); ++i)
         {
@@ -115,6 +126,10 @@ void ftcs_solver( int step ){
                            in[ti(x,y-1)] -
                            4*in[ti(x,y)]);
         }
+
+        if(thisThreadRank != 0){
+            perf_thread_stop(&perf_sample, &ftcs_perf);
+        }
     }
 }
 
@@ -158,7 +173,10 @@ int main ( int argc, char **argv ){
         if( step < CUTOFF ){
             external_heat ( step );
         }
+        /* Per cell: read in and material, write out (12 bytes), 7 flops */
+        perf_region_start(&ftcs_perf);
         ftcs_solver( step );
+        perf_region_stop(&ftcs_perf, 12.0*GRID_SIZE[0]*GRID_SIZE[1], 7.0*GRID_SIZE[0]*GRID_SIZE[1]);
             
         if((step % SNAPSHOT) == 0){
             write_temp(step);
@@ -168,6 +186,8 @@ int main ( int argc, char **argv ){
     free (temperature[0]);
     free (temperature[1]);
     free (material);
+
+    perf_region_report(&ftcs_perf, "");
         
     exit ( EXIT_SUCCESS );
 }
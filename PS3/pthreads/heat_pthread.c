@@ -5,6 +5,8 @@
 #include <omp.h>
 #include <pthread.h>
 
+#include "perfcount.h"
+
 
 /* Functions to be implemented: */
 void ftcs_solver ( int step );
@@ -75,6 +77,9 @@ const float
     
 int n_threads = 1;
 
+/* Counters around the stencil, only active when built with PERF=1 */
+perf_region_t ftcs_perf = PERF_REGION_INIT("ftcs_solver");
+
 
 
 
@@ -110,6 +115,9 @@ void* ftcs_solver_thread( void *arguments ){
     int whatEachThreadCanTake = whatWeNeedToLoopThru/numberOfThreads;
 
     int start = whatEachThreadCanTake*thisThreadRank;
+
+    perf_sample_t perf_sample;
+    perf_thread_start(&perf_sample);
     
     for (int i = start; i < (start+whatEachThreadCanTake); ++i)
     {
@@ -128,6 +136,7 @@ void* ftcs_solver_thread( void *arguments ){
                        4*in[ti(x,y)]);
     }
 
+    perf_thread_stop(&perf_sample, &ftcs_perf);
 }
 
 void ftcs_solver( int step ){ 
@@ -231,7 +240,10 @@ int main ( int argc, char **argv ){
         if( step < CUTOFF ){
             external_heat ( step );
         }
+        /* Per cell: read in and material, write out (12 bytes), 7 flops */
+        perf_region_start(&ftcs_perf);
         ftcs_solver( step );
+        perf_region_stop(&ftcs_perf, 12.0*GRID_SIZE[0]*GRID_SIZE[1], 7.0*GRID_SIZE[0]*GRID_SIZE[1]);
             
         if((step % SNAPSHOT) == 0){
             write_temp(step);
@@ -241,6 +253,8 @@ int main ( int argc, char **argv ){
     free (temperature[0]);
     free (temperature[1]);
     free (material);
+
+    perf_region_report(&ftcs_perf, "");
         
     exit ( EXIT_SUCCESS );
 }
@@ -8,6 +8,8 @@
 #include <cblas.h>
 #include <x86intrin.h>
 
+#include "perfcount.h"
+
 extern void chemm(complex float* A,
         complex float* B,
         complex float* C,
@@ -163,9 +165,16 @@ int main(int argc, char** argv){
     struct timeval start, end;
 
     // Running and timing the matrix multiplication
+    // Counters only active when built with PERF=1
+    // Complex multiply-add is 8 flops, A and B are read once, C read and written
+    perf_region_t chemm_perf = PERF_REGION_INIT("chemm");
     gettimeofday(&start, NULL);
+    perf_region_start(&chemm_perf);
     chemm(A,B,C,m,n,alpha,beta);
+    perf_region_stop(&chemm_perf, sizeof(complex float) * ((double)m*m + 2.0*m*n + m*n),
+            8.0 * m * m * n);
     gettimeofday(&end, NULL);
+    perf_region_report(&chemm_perf, "");
 
 
     long int ms = ((end.tv_sec * 1000000 + end.tv_usec) - (start.tv_sec * 1000000 + start.tv_usec));
@@ -1,14 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
 
+#include "perfcount.h"
+#include "mandel_kernel.h"
+#include "mandel_rect.h"
+#include "mandel_perturb.h"
+#include "mandel_dd.h"
+#include "mandel_steal.h"
+
 /* Shorthand for less typing */
 typedef unsigned char uchar;
 
 /* Declarations of output functions */
 void output();
+void outputLevel(int stride, char *name);
 void fancycolour(uchar *p, int iter);
+void writeBmpHeader(FILE *f, int x, int y);
 void savebmp(char *name, uchar *buffer, int x, int y);
 
 /* Struct for complex numbers */
@@ -21,12 +32,16 @@ const int XSIZE = 2560;
 const int YSIZE = 2048;
 
 /* Max number of iterations */
-const int MAXITER = 255;
+int MAXITER = 255;
+
+/* Centre and width of the view, set with -x, -y and -w. The centre is
+ * kept in double-double for the perturbation renderer.
+ */
+dd_t centreRe = { -0.5, 0 }, centreIm = { 0, 0 };
+double width = 3.0;
 
-/* Range in x direction */
-double xleft = -2.0;
-double xright = 1.0;
-double ycenter = 0.0;
+/* Range in x direction, calculated in main from the view */
+double xleft, xright, ycenter;
 
 /* Range in y direction, calculated in main
  * based on range in x direction and image size
@@ -39,6 +54,57 @@ double step;
 /* Global array for iteration counts/pixels */
 int* pixel;
 
+/* Escape time kernel chosen at startup with -k */
+const char *kernelName = "auto";
+mandel_span_fn kernel;
+mandel_params_t kernelParams = { .cull = 1, .period_eps = 1e-12 };
+mandel_stats_t kernelStats;
+
+/* Smallest rectangle side for Mariani-Silver subdivision (-m), 0 is off */
+int subdivideSize = 0;
+
+/* Adaptive MAXITER (-a frac): budgets double from ADAPTIVE_START up to
+ * MAXITER, and stop once pixels have started escaping but fewer than frac
+ * of the image escapes in a round
+ */
+#define ADAPTIVE_START 64
+int adaptive = 0;
+double adaptiveFraction;
+
+/* Progressive rendering (-g): a 1/PROGRESSIVE_COARSE resolution image
+ * first, then each level doubles the resolution down to full
+ */
+#define PROGRESSIVE_COARSE 8
+int progressive = 0;
+
+/* Whether images are written, from the n argument */
+int writeImage = 0;
+
+/* How pixels are computed. Below DD_STEP neighbouring pixels are a few
+ * ulps apart in double, so the double-double kernels take over, and
+ * below PERTURB_STEP the perturbation renderer does. -D and -P select
+ * either at any depth.
+ */
+#define DD_STEP 1e-13
+#define PERTURB_STEP 1e-20
+enum { RENDER_AUTO, RENDER_DOUBLE, RENDER_DD, RENDER_PERTURB } renderer = RENDER_AUTO;
+const char *rendererName[] = { "auto", "double", "double-double", "perturbation" };
+mandel_dd_span_fn ddKernel;
+mandel_reference_t reference;
+
+/* Work stealing threads for the double renderer (-t), and the tiles they
+ * took from each other */
+int threads = 1;
+long stolenTiles = 0;
+
+/* Rows [mirrorLo, mirrorHi) are copied from rows mirrorSum - j across the
+ * real axis instead of computed, see mandel_mirror_rows. -S turns it off */
+int symmetry = 1;
+int mirrorSum = -1, mirrorLo = 0, mirrorHi = 0;
+
+/* Counters around calculate, only active when built with PERF=1 */
+perf_region_t calculate_perf = PERF_REGION_INIT("calculate");
+
 
 /* Only for serial timings */
 double walltime() {
@@ -47,79 +113,396 @@ double walltime() {
     return (t.tv_sec + 1e-6 * t.tv_usec);
 }
 
-/* Calculate the number of iterations until divergence for each pixel.
- * If divergence never happens, return MAXITER
+/* Calculate the number of iterations until divergence for each pixel
+ * in rows [y0, y1). If divergence never happens, return MAXITER
+ */
+void calculateRows(int y0, int y1) {
+  if (y1 <= y0) {
+    return;
+  }
+  if (renderer == RENDER_DD) {
+    for (int j = y0; j < y1; j++) {
+      ddKernel(&kernelParams, &kernelStats, centreRe, step, dd_add(centreIm, dd_from(step * (j - YSIZE / 2))),
+               -(XSIZE / 2), XSIZE, &pixel[j * XSIZE]);
+    }
+    return;
+  }
+  if (renderer == RENDER_PERTURB) {
+    for (int j = y0; j < y1; j++) {
+      mandel_perturb_span(&reference, &kernelParams, &kernelStats, -step * (XSIZE / 2), step,
+                          step * (j - YSIZE / 2), 0, XSIZE, &pixel[j * XSIZE]);
+    }
+    return;
+  }
+  if (subdivideSize > 0) {
+    mandel_subdivide(kernel, &kernelParams, &kernelStats, xleft, ylower, step,
+                     XSIZE, y0, y1, &pixel[y0 * XSIZE], subdivideSize);
+    return;
+  }
+  if (threads > 1) {
+    double *ci = malloc(sizeof(double) * (y1 - y0));
+    for (int j = y0; j < y1; j++) {
+      ci[j - y0] = ylower + step * j;
+    }
+    stolenTiles += mandel_steal_render(kernel, &kernelParams, &kernelStats, threads, xleft, step,
+                                       ci, y1 - y0, XSIZE, &pixel[y0 * XSIZE]);
+    free(ci);
+    return;
+  }
+  for (int j = y0; j < y1; j++) {
+    kernel(&kernelParams, &kernelStats, xleft, step, ylower + step * j, 0, XSIZE, &pixel[j * XSIZE]);
+  }
+}
+
+/* Calculate the image, with the rows mirrored across the real axis copied.
+ * Their counts go into skipped, they were never iterated.
  */
 void calculate() {
-  for (int i = 0; i < XSIZE; i++) {
-    for (int j = 0; j < YSIZE; j++) {
-      complex_t c, z, temp;
-      int iter = 0;
-      c.real = (xleft + step * i);
-      c.imag = (ylower + step * j);
-      z = c;
-      while (z.real * z.real + z.imag * z.imag < 4) {
-        temp.real = z.real * z.real - z.imag * z.imag + c.real;
-        temp.imag = 2 * z.real * z.imag + c.imag;
-        z = temp;
-        iter++;
-        if(iter == MAXITER){
-            break;
+  if (renderer == RENDER_PERTURB) {
+    mandel_reference(&reference, centreRe, centreIm, MAXITER);
+    mandel_series(&reference, MAXITER, step * (XSIZE / 2), step * (YSIZE / 2), 1e-9);
+  }
+  calculateRows(0, mirrorLo);
+  calculateRows(mirrorHi, YSIZE);
+  for (int j = mirrorLo; j < mirrorHi; j++) {
+    memcpy(&pixel[j * XSIZE], &pixel[(mirrorSum - j) * XSIZE], sizeof(int) * XSIZE);
+    for (int i = 0; i < XSIZE; i++) {
+      kernelStats.skipped += pixel[j * XSIZE + i];
+    }
+  }
+}
+
+/* Adaptive MAXITER. Unescaped pixels keep their orbit state in a compact
+ * list, and every round continues only those with a doubled budget, so
+ * no pixel is iterated from the start twice. Pixels still in the list at
+ * the end are interior, and MAXITER becomes the last budget.
+ */
+void calculateAdaptive() {
+  mandel_orbit_t *orbits = malloc(sizeof(mandel_orbit_t) * XSIZE * YSIZE);
+  long live = 0;
+  for (int j = 0; j < YSIZE; j++) {
+    for (int i = 0; i < XSIZE; i++) {
+      double cr = xleft + step * i, ci = ylower + step * j;
+      if (kernelParams.cull && mandel_culled(cr, ci)) {
+        pixel[j * XSIZE + i] = -1;
+        kernelStats.culled++;
+        continue;
+      }
+      orbits[live++] = (mandel_orbit_t){ j * XSIZE + i, 0, cr, ci };
+    }
+  }
+
+  int budget = ADAPTIVE_START < MAXITER ? ADAPTIVE_START : MAXITER;
+  long total = 0;
+  for (;;) {
+    long kept = 0;
+    for (long k = 0; k < live; k++) {
+      mandel_orbit_t o = orbits[k];
+      double cr = xleft + step * (o.index % XSIZE), ci = ylower + step * (o.index / XSIZE);
+      if (mandel_continue(&o, cr, ci, budget)) {
+        pixel[o.index] = o.iter;
+      } else {
+        orbits[kept++] = o;
+      }
+    }
+    long escaped = live - kept;
+    live = kept;
+    total += escaped;
+    printf("Budget %d: %ld pixels escaped (%.3f%%), %ld left\n",
+           budget, escaped, 100.0 * escaped / ((double) XSIZE * YSIZE), live);
+    if (budget == MAXITER || (total > 0 && escaped < adaptiveFraction * XSIZE * YSIZE)) {
+      break;
+    }
+    budget = 2 * budget < MAXITER ? 2 * budget : MAXITER;
+  }
+
+  for (long k = 0; k < live; k++) {
+    pixel[orbits[k].index] = budget;
+  }
+  for (int i = 0; i < XSIZE * YSIZE; i++) {
+    if (pixel[i] == -1) {
+      pixel[i] = budget;
+    }
+  }
+  kernelStats.skipped += (double) budget * kernelStats.culled;
+  MAXITER = budget;
+  free(orbits);
+}
+
+/* Progressive rendering. Level s samples every s'th pixel in both
+ * directions, keeping the samples of the coarser levels. A new sample
+ * whose four neighbours on the previous level agree takes their count
+ * without iterating. Each coarse level is written as mandel2_level<s>.bmp
+ * as soon as it is done, samples blown up to blocks.
+ */
+void calculateProgressive() {
+  /* -2 is not sampled yet, -1 is to be computed at this level */
+  for (int i = 0; i < XSIZE * YSIZE; i++) {
+    pixel[i] = -2;
+  }
+  for (int s = PROGRESSIVE_COARSE; s >= 1; s /= 2) {
+    double t = walltime();
+    long computed = 0, filled = 0;
+    for (int j = 0; j < YSIZE; j += s) {
+      for (int i = 0; i < XSIZE; i += s) {
+        int *p = &pixel[j * XSIZE + i];
+        if (*p != -2) {
+          continue;
+        }
+        int c = 2 * s, i0 = i - i % c, j0 = j - j % c;
+        if (s < PROGRESSIVE_COARSE && i0 + c < XSIZE && j0 + c < YSIZE) {
+          int v = pixel[j0 * XSIZE + i0];
+          if (pixel[j0 * XSIZE + i0 + c] == v && pixel[(j0 + c) * XSIZE + i0] == v &&
+              pixel[(j0 + c) * XSIZE + i0 + c] == v) {
+            *p = v;
+            filled++;
+            kernelStats.skipped += v;
+            continue;
+          }
         }
+        *p = -1;
+        computed++;
       }
-      pixel[j * XSIZE + i] = iter;
+    }
+    for (int j = 0; j < YSIZE; j += s) {
+      mandel_rect_row(kernel, &kernelParams, &kernelStats, xleft, ylower, step,
+                      &pixel[j * XSIZE], j, 0, XSIZE);
+    }
+    kernelStats.filled += filled;
+    printf("Level 1/%d: %ld computed, %ld filled, %f s\n", s, computed, filled, walltime() - t);
+
+    /* The full resolution level is the normal output */
+    if (writeImage && s > 1) {
+      char name[32];
+      sprintf(name, "mandel2_level%d.bmp", s);
+      outputLevel(s, name);
     }
   }
 }
 
+/* Total iterations spent on the image */
+double count_iterations() {
+  double sum = 0;
+  for (int i = 0; i < XSIZE * YSIZE; i++) {
+    sum += pixel[i];
+  }
+  return sum;
+}
 
 int main(int argc, char **argv) {
     
     /* Check input arguments */
-  if (argc == 1) {
-    puts("Usage: MANDEL n");
+  int opt;
+  while ((opt = getopt(argc, argv, "k:ce:m:i:x:y:w:DPa:gSt:")) != -1) {
+    switch (opt) {
+      case 'k':
+        kernelName = optarg;
+        break;
+      case 'c':
+        kernelParams.cull = 0;
+        break;
+      case 'e':
+        kernelParams.period_eps = strtod(optarg, NULL);
+        break;
+      case 'm':
+        subdivideSize = strtol(optarg, NULL, 10);
+        break;
+      case 'i':
+        MAXITER = strtol(optarg, NULL, 10);
+        break;
+      case 'x':
+        if (dd_parse(optarg, &centreRe) == 0) {
+          return 0;
+        }
+        break;
+      case 'y':
+        if (dd_parse(optarg, &centreIm) == 0) {
+          return 0;
+        }
+        break;
+      case 'w':
+        width = strtod(optarg, NULL);
+        break;
+      case 'D':
+        renderer = RENDER_DD;
+        break;
+      case 'P':
+        renderer = RENDER_PERTURB;
+        break;
+      case 'a':
+        adaptive = 1;
+        adaptiveFraction = strtod(optarg, NULL);
+        break;
+      case 'g':
+        progressive = 1;
+        break;
+      case 'S':
+        symmetry = 0;
+        break;
+      case 't':
+        threads = strtol(optarg, NULL, 10);
+        break;
+      default:
+        return 0;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc == 1 || MAXITER < 1 || !(width > 0) || threads < 1) {
+    puts("Usage: MANDEL [-k kernel] [-c] [-e eps] [-m size] [-x re -y im -w width] [-i iter] [-D | -P] [-a frac | -g] [-S] [-t threads] n");
     puts("n decides whether image should be written to disk (1 = yes, 0 = no)");
+    puts("-k kernel: auto, scalar, avx2 or avx512 (default auto)");
+    puts("-c: iterate points inside the cardioid and bulb instead of culling them");
+    puts("-e eps: periodicity check tolerance, 0 turns it off (default 1e-12)");
+    puts("-m size: fill rectangles with a uniform border, down to this side length");
+    puts("-x re -y im -w width: centre and width of the view (default -0.5 0 3)");
+    puts("-i iter: maximum number of iterations (default 255)");
+    puts("-D: double-double kernel, used anyway once a pixel is below 1e-13 wide");
+    puts("-P: perturbation renderer, used anyway once a pixel is below 1e-20 wide");
+    puts("-a frac: raise MAXITER from 64 up to -i until under frac of the image escapes per round");
+    puts("-g: progressive, write 1/8, 1/4 and 1/2 resolution images before the full one");
+    puts("-S: compute both halves of a view centred on the real axis instead of mirroring");
+    puts("-t threads: share the double renderer's rows over threads with work stealing,");
+    puts("   not with -m, -a or -g");
     return 0;
   }
+
+  /* Pick the escape time kernel once, before any work */
+  kernel = mandel_select(kernelName, &kernelName);
+  if (kernel == NULL) {
+    printf("Kernel %s is unknown or not supported by this CPU\n", kernelName);
+    return 0;
+  }
+  ddKernel = mandel_dd_select(kernelName);
+  kernelParams.maxiter = MAXITER;
+  printf("Kernel: %s\n", kernelName);
   
   /* Calculate the range in the y - axis such that we preserve the aspect ratio */
-  step = (xright - xleft)/XSIZE;
+  xleft = centreRe.hi - width/2;
+  xright = centreRe.hi + width/2;
+  ycenter = centreIm.hi;
+  step = width/XSIZE;
+  if (renderer == RENDER_AUTO) {
+    renderer = step < PERTURB_STEP ? RENDER_PERTURB : step < DD_STEP ? RENDER_DD : RENDER_DOUBLE;
+  }
+  if (renderer == RENDER_DD && ddKernel == NULL) {
+    printf("Kernel %s has no double-double version on this CPU\n", kernelName);
+    return 0;
+  }
+  if (renderer != RENDER_DOUBLE) {
+    printf("Renderer: %s\n", rendererName[renderer]);
+  }
+  if ((adaptive || progressive) && renderer != RENDER_DOUBLE) {
+    puts("-a and -g need the double renderer");
+    return 0;
+  }
+  if (adaptive && progressive) {
+    puts("-a and -g cannot be combined");
+    return 0;
+  }
+  if (threads > 1 && (renderer != RENDER_DOUBLE || subdivideSize > 0 || adaptive || progressive)) {
+    puts("-t needs the double renderer without -m, -a or -g");
+    return 0;
+  }
+  writeImage = strtol(argv[1], NULL, 10) != 0;
   yupper = ycenter + (step * YSIZE)/2;
   ylower = ycenter - (step * YSIZE)/2;
+
+  /* Mirroring needs the rows exactly symmetric, for the double-double and
+   * perturbation renderers that means a centre exactly on the axis */
+  if (symmetry && !adaptive && !progressive &&
+      (renderer == RENDER_DOUBLE || (centreIm.hi == 0 && centreIm.lo == 0))) {
+    mirrorSum = mandel_mirror_rows(ylower, step, YSIZE, &mirrorLo, &mirrorHi);
+  }
+  if (mirrorSum >= 0) {
+    printf("Mirrored %d rows across the real axis\n", mirrorHi - mirrorLo);
+  }
   
   /* Allocate memory for the entire image */
   pixel = (int*) malloc(sizeof(int) * XSIZE * YSIZE);
   
 
-  /* Perform calculation */
-  calculate();
+  /* Perform calculation, each iteration costs about 8 flops.
+   * Culled, periodic and filled pixels hold counts they never iterated.
+   */
+  perf_region_start(&calculate_perf);
+  if (adaptive) {
+    calculateAdaptive();
+    printf("Adaptive MAXITER %d\n", MAXITER);
+  } else if (progressive) {
+    calculateProgressive();
+  } else {
+    calculate();
+  }
+  perf_region_stop(&calculate_perf, 4.0 * XSIZE * YSIZE,
+                   8.0 * (count_iterations() - kernelStats.skipped));
+  perf_region_report(&calculate_perf, "");
+  if (kernelParams.cull && renderer == RENDER_DOUBLE) {
+    printf("Culled %ld pixels inside the cardioid and bulb (%.1f%%)\n",
+           kernelStats.culled, 100.0 * kernelStats.culled / ((double) XSIZE * YSIZE));
+  }
+  if (kernelParams.period_eps > 0 && renderer == RENDER_DOUBLE && !adaptive) {
+    printf("Stopped %ld pixels on a periodic orbit (%.1f%%)\n",
+           kernelStats.periodic, 100.0 * kernelStats.periodic / ((double) XSIZE * YSIZE));
+  }
+  if ((subdivideSize > 0 || progressive) && renderer == RENDER_DOUBLE && !adaptive) {
+    printf("Filled %ld pixels from uniform surroundings (%.1f%%)\n",
+           kernelStats.filled, 100.0 * kernelStats.filled / ((double) XSIZE * YSIZE));
+  }
+  if (threads > 1) {
+    printf("%d threads, %ld tiles of %dx%d stolen\n", threads, stolenTiles, MANDEL_TILE_W, MANDEL_TILE_H);
+  }
+  if (renderer == RENDER_PERTURB) {
+    printf("Reference orbit %d iterations, series skips %d, %ld rebases\n",
+           reference.len - 1, reference.skip - 1, kernelStats.rebased);
+    mandel_reference_free(&reference);
+  }
 
   /* Output */
-  if (strtol(argv[1], NULL, 10) != 0) {
+  if (writeImage) {
       output();
   }
   
   return 0;
 }
 
-/* Save 24 - bits bmp file, buffer must be in bmp format: upside - down */
-void savebmp(char *name, uchar *buffer, int x, int y) {
-  FILE *f = fopen(name, "wb");
-  if (!f) {
-    printf("Error writing image to disk.\n");
-    return;
+/* Write the 54 byte header of a 24 - bits bmp file, x by y pixels */
+void writeBmpHeader(FILE *f, int x, int y) {
+  unsigned long rowBytes = ((unsigned long) x * 3 + 3) & ~3UL;
+  unsigned long size = rowBytes * y + 54;
+  /* Sizes past 4 GB do not fit, readers go by width and height then */
+  if (size > 0xffffffffUL) {
+    size = 0;
   }
-  unsigned int size = x * y * 3 + 54;
   uchar header[54] = {'B', 'M',
                       size&255,
                       (size >> 8)&255,
                       (size >> 16)&255,
-                      size >> 24,
-                      0, 0, 0, 0, 54, 0, 0, 0, 40, 0, 0, 0, x&255, x >> 8, 0,
-                      0, y&255, y >> 8, 0, 0, 1, 0, 24, 0, 0, 0, 0, 0, 0, 0,
+                      (size >> 24)&255,
+                      0, 0, 0, 0, 54, 0, 0, 0, 40, 0, 0, 0,
+                      x&255, (x >> 8)&255, (x >> 16)&255, (x >> 24)&255,
+                      y&255, (y >> 8)&255, (y >> 16)&255, (y >> 24)&255,
+                      1, 0, 24, 0, 0, 0, 0, 0, 0, 0,
                       0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
   fwrite(header, 1, 54, f);
-  fwrite(buffer, 1, XSIZE * YSIZE * 3, f);
+}
+
+/* Save 24 - bits bmp file, buffer must be in bmp format: upside - down.
+ * The buffer rows are x*3 bytes, in the file they are padded to 4 bytes */
+void savebmp(char *name, uchar *buffer, int x, int y) {
+  FILE *f = fopen(name, "wb");
+  if (!f) {
+    printf("Error writing image to disk.\n");
+    return;
+  }
+  writeBmpHeader(f, x, y);
+  const uchar pad[3] = { 0, 0, 0 };
+  size_t rowBytes = (size_t) x * 3;
+  for (int j = 0; j < y; j++) {
+    fwrite(buffer + rowBytes * j, 1, rowBytes, f);
+    fwrite(pad, 1, (4 - rowBytes % 4) % 4, f);
+  }
   fclose(f);
 }
 
@@ -134,14 +517,21 @@ void fancycolour(uchar *p, int iter) {
 
 /* Create nice image from iteration counts. take care to create it upside down (bmp format) */
 void output(){
+    outputLevel(1, "mandel2.bmp");
+}
+
+/* Image from every stride'th sample in both directions, each one drawn
+ * as a stride x stride block
+ */
+void outputLevel(int stride, char *name){
     unsigned char *buffer = calloc(XSIZE * YSIZE * 3, 1);
     for (int i = 0; i < XSIZE; i++) {
       for (int j = 0; j < YSIZE; j++) {
         int p = ((YSIZE - j - 1) * XSIZE + i) * 3;
-        fancycolour(buffer + p, pixel[(i + XSIZE * j)]);
+        fancycolour(buffer + p, pixel[(i - i % stride) + XSIZE * (j - j % stride)]);
       }
     }
     /* write image to disk */
-    savebmp("mandel2.bmp", buffer, XSIZE, YSIZE);
+    savebmp(name, buffer, XSIZE, YSIZE);
     free(buffer);
 }
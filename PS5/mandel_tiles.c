@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "mandel_kernel.h"
+
+/*
+ * Renders a stream of viewports from tiles of iteration counts that are
+ * cached between requests. A tile is TILE x TILE pixels and is addressed
+ * by (zoom level, tile x, tile y, MAXITER). At zoom level z a pixel is
+ * BASE_STEP / 2^z wide, and tile (tx, ty) has its corner at
+ * c = (tx, ty) * TILE * step, so tiles line up across requests and pans
+ * or zoom-outs reuse what earlier viewports computed.
+ *
+ * Tiles live in memory up to a limit and are evicted least recently used
+ * first. Evicted tiles are spilled to files in the tile directory, which
+ * also lets the next run start with a warm cache.
+ */
+
+/* Shorthand for less typing */
+typedef unsigned char uchar;
+
+/* Declarations of output functions */
+void output(char *name, int *counts, int x, int y);
+void fancycolour(uchar *p, int iter);
+void writeBmpHeader(FILE *f, int x, int y);
+void savebmp(char *name, uchar *buffer, int x, int y);
+
+#define TILE 256
+#define BASE_STEP (1.0 / 256)
+#define BUCKETS 4096
+
+/* Size of a viewport, in pixels */
+int XSIZE = 1024;
+int YSIZE = 768;
+
+/* Max number of iterations */
+int MAXITER = 255;
+
+/* Tiles kept in memory and where evicted ones go */
+int cacheTiles = 256;
+const char *tileDir = "tiles";
+
+typedef struct tile {
+    int zoom, maxiter;
+    long tx, ty;
+    int *counts;
+    struct tile *next;              /* hash chain */
+    struct tile *newer, *older;     /* LRU list */
+    int onDisk;
+} tile_t;
+
+tile_t *buckets[BUCKETS];
+tile_t *newest, *oldest;
+int tilesInMemory = 0;
+
+/* Cache statistics */
+long memoryHits, diskHits, misses, evictions, spills;
+
+/* Escape time kernel chosen at startup with -k */
+const char *kernelName = "auto";
+mandel_span_fn kernel;
+mandel_params_t kernelParams = { .cull = 1, .period_eps = 1e-12 };
+mandel_stats_t kernelStats;
+
+double walltime() {
+    static struct timeval t;
+    gettimeofday(&t, NULL);
+    return (t.tv_sec + 1e-6 * t.tv_usec);
+}
+
+unsigned hashKey(int zoom, long tx, long ty, int maxiter) {
+    unsigned long h = (unsigned long) zoom * 0x9E3779B97F4A7C15UL;
+    h ^= (unsigned long) tx * 0xC2B2AE3D27D4EB4FUL + (h << 6) + (h >> 2);
+    h ^= (unsigned long) ty * 0x165667B19E3779F9UL + (h << 6) + (h >> 2);
+    h ^= (unsigned long) maxiter + (h << 6) + (h >> 2);
+    return (unsigned) (h % BUCKETS);
+}
+
+/* The file of a tile in the tile directory, 0 if the name does not fit */
+int tileFile(char *name, size_t size, int zoom, long tx, long ty, int maxiter) {
+    int n = snprintf(name, size, "%s/%d_%ld_%ld_%d.tile", tileDir, zoom, tx, ty, maxiter);
+    return n >= 0 && (size_t) n < size;
+}
+
+/* LRU list: newest at the head */
+void unlinkTile(tile_t *t) {
+    if (t->newer) t->newer->older = t->older; else newest = t->older;
+    if (t->older) t->older->newer = t->newer; else oldest = t->newer;
+    t->newer = t->older = NULL;
+}
+
+void pushNewest(tile_t *t) {
+    t->older = newest;
+    t->newer = NULL;
+    if (newest) newest->newer = t; else oldest = t;
+    newest = t;
+}
+
+/* Drops the least recently used tile, writing it out first if the tile
+ * directory does not have it yet
+ */
+void evictOldest() {
+    tile_t *t = oldest;
+    unlinkTile(t);
+    tile_t **p = &buckets[hashKey(t->zoom, t->tx, t->ty, t->maxiter)];
+    while (*p != t) {
+        p = &(*p)->next;
+    }
+    *p = t->next;
+
+    char name[256];
+    if (!t->onDisk && tileFile(name, sizeof(name), t->zoom, t->tx, t->ty, t->maxiter)) {
+        FILE *f = fopen(name, "wb");
+        if (f) {
+            fwrite(t->counts, sizeof(int), TILE * TILE, f);
+            fclose(f);
+            spills++;
+        }
+    }
+    free(t->counts);
+    free(t);
+    tilesInMemory--;
+    evictions++;
+}
+
+/* The corner goes to the kernel as a coordinate, pixel numbers past
+ * zoom 23 no longer fit the kernel's int offset */
+void computeTile(tile_t *t) {
+    double step = ldexp(BASE_STEP, -t->zoom);
+    double x0 = (double) t->tx * TILE * step;
+    for (int j = 0; j < TILE; j++) {
+        kernel(&kernelParams, &kernelStats, x0, step, ((double) t->ty * TILE + j) * step,
+               0, TILE, &t->counts[j * TILE]);
+    }
+}
+
+/* The tile from memory, from the tile directory or newly computed */
+tile_t *getTile(int zoom, long tx, long ty) {
+    unsigned h = hashKey(zoom, tx, ty, MAXITER);
+    for (tile_t *t = buckets[h]; t; t = t->next) {
+        if (t->zoom == zoom && t->tx == tx && t->ty == ty && t->maxiter == MAXITER) {
+            memoryHits++;
+            unlinkTile(t);
+            pushNewest(t);
+            return t;
+        }
+    }
+
+    if (tilesInMemory == cacheTiles) {
+        evictOldest();
+    }
+    tile_t *t = calloc(1, sizeof(tile_t));
+    t->zoom = zoom;
+    t->tx = tx;
+    t->ty = ty;
+    t->maxiter = MAXITER;
+    t->counts = malloc(sizeof(int) * TILE * TILE);
+
+    char name[256];
+    FILE *f = tileFile(name, sizeof(name), zoom, tx, ty, MAXITER) ? fopen(name, "rb") : NULL;
+    if (f && fread(t->counts, sizeof(int), TILE * TILE, f) == TILE * TILE) {
+        diskHits++;
+        t->onDisk = 1;
+    } else {
+        misses++;
+        computeTile(t);
+    }
+    if (f) {
+        fclose(f);
+    }
+
+    t->next = buckets[h];
+    buckets[h] = t;
+    pushNewest(t);
+    tilesInMemory++;
+    return t;
+}
+
+/* Floor division, tiles left of or below the origin have negative numbers */
+long floorDiv(long a, long b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+/* Composes the viewport centred on (cx, cy) at a zoom level into counts.
+ * The centre is snapped to the pixel grid of that level.
+ */
+void renderView(double cx, double cy, int zoom, int *counts) {
+    double step = ldexp(BASE_STEP, -zoom);
+    long px0 = lround(cx / step) - XSIZE / 2;
+    long py0 = lround(cy / step) - YSIZE / 2;
+
+    for (long ty = floorDiv(py0, TILE); ty <= floorDiv(py0 + YSIZE - 1, TILE); ty++) {
+        for (long tx = floorDiv(px0, TILE); tx <= floorDiv(px0 + XSIZE - 1, TILE); tx++) {
+            tile_t *t = getTile(zoom, tx, ty);
+            /* Overlap of the tile and the viewport, in global pixels */
+            long x0 = tx * TILE > px0 ? tx * TILE : px0;
+            long x1 = (tx + 1) * TILE < px0 + XSIZE ? (tx + 1) * TILE : px0 + XSIZE;
+            long y0 = ty * TILE > py0 ? ty * TILE : py0;
+            long y1 = (ty + 1) * TILE < py0 + YSIZE ? (ty + 1) * TILE : py0 + YSIZE;
+            for (long y = y0; y < y1; y++) {
+                memcpy(&counts[(y - py0) * XSIZE + (x0 - px0)],
+                       &t->counts[(y - ty * TILE) * TILE + (x0 - tx * TILE)],
+                       sizeof(int) * (x1 - x0));
+            }
+        }
+    }
+}
+
+/* Renders the viewport again without tiles and returns the number of
+ * pixels that differ from counts. Tile and viewport corners are both whole
+ * multiples of step, so the two agree exactly.
+ */
+long verifyView(double cx, double cy, int zoom, const int *counts) {
+    double step = ldexp(BASE_STEP, -zoom);
+    long px0 = lround(cx / step) - XSIZE / 2;
+    long py0 = lround(cy / step) - YSIZE / 2;
+    int *row = malloc(sizeof(int) * XSIZE);
+    long differ = 0;
+    for (int j = 0; j < YSIZE; j++) {
+        kernel(&kernelParams, &kernelStats, (double) px0 * step, step, (double) (py0 + j) * step,
+               0, XSIZE, row);
+        for (int i = 0; i < XSIZE; i++) {
+            differ += row[i] != counts[(long) j * XSIZE + i];
+        }
+    }
+    free(row);
+    return differ;
+}
+
+int main(int argc, char **argv) {
+
+  /* Check input arguments */
+  int opt, writeImages = 0, verify = 0;
+  while ((opt = getopt(argc, argv, "k:i:c:d:W:H:ov")) != -1) {
+    switch (opt) {
+      case 'k':
+        kernelName = optarg;
+        break;
+      case 'i':
+        MAXITER = strtol(optarg, NULL, 10);
+        break;
+      case 'c':
+        cacheTiles = strtol(optarg, NULL, 10);
+        break;
+      case 'd':
+        tileDir = optarg;
+        break;
+      case 'W':
+        XSIZE = strtol(optarg, NULL, 10);
+        break;
+      case 'H':
+        YSIZE = strtol(optarg, NULL, 10);
+        break;
+      case 'o':
+        writeImages = 1;
+        break;
+      case 'v':
+        verify = 1;
+        break;
+      default:
+        return 0;
+    }
+  }
+
+  if (optind != argc || MAXITER < 1 || cacheTiles < 1 || XSIZE < 1 || YSIZE < 1) {
+    puts("Usage: MANDEL_TILES [-k kernel] [-i iter] [-c tiles] [-d dir] [-W width -H height] [-o] [-v] < views");
+    puts("Reads one viewport per line as: centre_re centre_im zoom");
+    puts("A pixel is 1/256 wide at zoom 0 and halves with every zoom level");
+    puts("-c tiles: tiles of 256x256 counts kept in memory (default 256)");
+    puts("-d dir: where evicted tiles are spilled and looked up (default tiles)");
+    puts("-o: write every viewport to view<n>.bmp");
+    puts("-v: check every viewport against a render without tiles, exit 1 on a mismatch");
+    return 0;
+  }
+
+  kernel = mandel_select(kernelName, &kernelName);
+  if (kernel == NULL) {
+    printf("Kernel %s is unknown or not supported by this CPU\n", kernelName);
+    return 0;
+  }
+  kernelParams.maxiter = MAXITER;
+
+  /* Every tile name has to fit, down to the longest numbers it can hold */
+  char longest[256];
+  if (!tileFile(longest, sizeof(longest), INT_MIN, LONG_MIN, LONG_MIN, INT_MIN)) {
+    printf("Tile directory %s is too long\n", tileDir);
+    return 1;
+  }
+  mkdir(tileDir, 0755);
+
+  int *counts = malloc(sizeof(int) * XSIZE * YSIZE);
+  double cx, cy;
+  int zoom, views = 0;
+  long mismatches = 0;
+  double start = walltime();
+  while (scanf("%lf %lf %d", &cx, &cy, &zoom) == 3) {
+    long before = misses;
+    double t = walltime();
+    renderView(cx, cy, zoom, counts);
+    printf("View %d: (%g, %g) zoom %d, %ld tiles computed, %f s\n",
+           views, cx, cy, zoom, misses - before, walltime() - t);
+    if (verify) {
+      long differ = verifyView(cx, cy, zoom, counts);
+      if (differ) {
+        printf("View %d: %ld pixels differ from a render without tiles\n", views, differ);
+      }
+      mismatches += differ;
+    }
+    if (writeImages) {
+      char name[32];
+      if (snprintf(name, sizeof(name), "view%d.bmp", views) < (int) sizeof(name)) {
+        output(name, counts, XSIZE, YSIZE);
+      } else {
+        printf("View %d: image name too long, not written\n", views);
+      }
+    }
+    views++;
+  }
+
+  long requests = memoryHits + diskHits + misses;
+  printf("%d views in %f s\n", views, walltime() - start);
+  printf("Tile requests %ld: %ld memory hits, %ld disk hits, %ld computed (hit rate %.1f%%)\n",
+         requests, memoryHits, diskHits, misses,
+         requests ? 100.0 * (memoryHits + diskHits) / requests : 0.0);
+  printf("Evicted %ld tiles, %ld spilled to %s\n", evictions, spills, tileDir);
+
+  /* Spill what is still in memory so the next run finds it */
+  while (oldest) {
+    evictOldest();
+  }
+  free(counts);
+  return mismatches ? 1 : 0;
+}
+
+/* Write the 54 byte header of a 24 - bits bmp file, x by y pixels */
+void writeBmpHeader(FILE *f, int x, int y) {
+  unsigned long rowBytes = ((unsigned long) x * 3 + 3) & ~3UL;
+  unsigned long size = rowBytes * y + 54;
+  /* Sizes past 4 GB do not fit, readers go by width and height then */
+  if (size > 0xffffffffUL) {
+    size = 0;
+  }
+  uchar header[54] = {'B', 'M',
+                      size&255,
+                      (size >> 8)&255,
+                      (size >> 16)&255,
+                      (size >> 24)&255,
+                      0, 0, 0, 0, 54, 0, 0, 0, 40, 0, 0, 0,
+                      x&255, (x >> 8)&255, (x >> 16)&255, (x >> 24)&255,
+                      y&255, (y >> 8)&255, (y >> 16)&255, (y >> 24)&255,
+                      1, 0, 24, 0, 0, 0, 0, 0, 0, 0,
+                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  fwrite(header, 1, 54, f);
+}
+
+/* Save 24 - bits bmp file, buffer must be in bmp format: upside - down.
+ * The buffer rows are x*3 bytes, in the file they are padded to 4 bytes */
+void savebmp(char *name, uchar *buffer, int x, int y) {
+  FILE *f = fopen(name, "wb");
+  if (!f) {
+    printf("Error writing image to disk.\n");
+    return;
+  }
+  writeBmpHeader(f, x, y);
+  const uchar pad[3] = { 0, 0, 0 };
+  size_t rowBytes = (size_t) x * 3;
+  for (int j = 0; j < y; j++) {
+    fwrite(buffer + rowBytes * j, 1, rowBytes, f);
+    fwrite(pad, 1, (4 - rowBytes % 4) % 4, f);
+  }
+  fclose(f);
+}
+
+/* Given iteration number, set a colour */
+void fancycolour(uchar *p, int iter) {
+  if (iter == MAXITER);
+  else if (iter < 8) { p[0] = 128 + iter * 16; p[1] = p[2] = 0; }
+  else if (iter < 24) { p[0] = 255; p[1] = p[2] = (iter - 8) * 16; }
+  else if (iter < 160) { p[0] = p[1] = 255 - (iter - 24) * 2; p[2] = 255; }
+  else { p[0] = p[1] = (iter - 160) * 2; p[2] = 255 - (iter - 160) * 2; }
+}
+
+/* Create nice image from iteration counts. take care to create it upside down (bmp format) */
+void output(char *name, int *counts, int x, int y){
+    unsigned char *buffer = calloc(x * y * 3, 1);
+    for (int i = 0; i < x; i++) {
+      for (int j = 0; j < y; j++) {
+        int p = ((y - j - 1) * x + i) * 3;
+        fancycolour(buffer + p, counts[(i + x * j)]);
+      }
+    }
+    /* write image to disk */
+    savebmp(name, buffer, x, y);
+    free(buffer);
+}
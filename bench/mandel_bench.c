@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <mpi.h>
+
+#include "dd.h"
+#include "mandel_kernel.h"
+#include "mandel_perturb.h"
+#include "mandel_dd.h"
+#include "mandel_steal.h"
+
+/*
+ * Benchmark for the Mandelbrot engines in ../common.
+ *
+ * Renders a fixed set of views at several sizes and MAXITER values with
+ * every engine this CPU runs: the scalar and vector span kernels, the work
+ * stealing renderer at 1, 2, 4, ... threads per rank, and for the deep
+ * zoom the double-double kernel and the perturbation renderer. The rows
+ * are split into equal blocks over the MPI ranks, as in manPar's static
+ * schedule.
+ *
+ * For every run it reports pixels per second, iterations per second and
+ * the load imbalance over the ranks as max/avg compute time. Iterations
+ * are those actually run: culled, periodic and series skipped iterations
+ * are not counted. The fraction of pixels that escaped is written too, a
+ * view where none escape only measures how fast the engines reach MAXITER.
+ *
+ * Usage: mpirun -np <ranks> mandel_bench [csv file]
+ */
+
+/* Minimum time spent in each measurement */
+const double MIN_TIME = 0.5;
+
+typedef struct {
+    const char *name;
+    const char *re, *im;    /* centre, parsed in double-double */
+    double width;
+    int deep;               /* needs the double-double or perturbation engines */
+    int maxiter[2];
+} view_t;
+
+const view_t views[] = {
+    { "full", "-0.5", "0", 3.0, 0, { 256, 1024 } },
+    { "seahorse", "-0.7453", "0.1127", 6.5e-3, 0, { 256, 1024 } },
+    { "interior", "-0.1226", "0.7449", 0.2, 0, { 256, 1024 } },
+    /* No pixel of the deep zoom escapes before about 2000 iterations */
+    { "deep", "-0.743643887037158704752191506114774", "0.131825904205311970493132056385139",
+      1e-12, 1, { 4096, 16384 } },
+};
+#define N_VIEWS (int) (sizeof(views) / sizeof(views[0]))
+
+const int sizes[][2] = { { 640, 512 }, { 1280, 1024 } };
+#define N_SIZES (int) (sizeof(sizes) / sizeof(sizes[0]))
+
+enum { ENGINE_SPAN, ENGINE_STEAL, ENGINE_DD, ENGINE_PERTURB };
+
+/* One run: a view at a size and MAXITER with one engine */
+typedef struct {
+    const view_t *view;
+    int width, height, maxiter;
+    int engine;
+    mandel_span_fn kernel;
+    mandel_dd_span_fn dd_kernel;
+    int threads;
+} bench_case_t;
+
+int rank, n_ranks;
+
+/* Renders rows [y0, y1) into out, returns the iterations actually run and
+ * sets escaped to the number of pixels below MAXITER */
+double render(const bench_case_t *c, int y0, int y1, int *out, long *stolen, long *escaped){
+    mandel_params_t p = { .maxiter = c->maxiter, .cull = 1, .period_eps = 1e-12 };
+    mandel_stats_t s = { 0 };
+    dd_t centre_re, centre_im;
+    dd_parse(c->view->re, &centre_re);
+    dd_parse(c->view->im, &centre_im);
+    double step = c->view->width / c->width;
+    double xleft = centre_re.hi - c->view->width / 2;
+    double ylower = centre_im.hi - step * c->height / 2;
+
+    if(c->engine == ENGINE_SPAN){
+        for(int j = y0; j < y1; j++){
+            c->kernel(&p, &s, xleft, step, ylower + step * j, 0, c->width, &out[(long) (j - y0) * c->width]);
+        }
+    }
+    else if(c->engine == ENGINE_STEAL){
+        double *ci = malloc((y1 - y0 + 1) * sizeof(double));
+        for(int j = y0; j < y1; j++){
+            ci[j - y0] = ylower + step * j;
+        }
+        *stolen += mandel_steal_render(c->kernel, &p, &s, c->threads, xleft, step, ci,
+                                       y1 - y0, c->width, out);
+        free(ci);
+    }
+    else if(c->engine == ENGINE_DD){
+        for(int j = y0; j < y1; j++){
+            c->dd_kernel(&p, &s, centre_re, step, dd_add(centre_im, dd_from(step * (j - c->height / 2))),
+                         -(c->width / 2), c->width, &out[(long) (j - y0) * c->width]);
+        }
+    }
+    else{
+        /* Every rank iterates the reference, that is part of the cost */
+        mandel_reference_t ref;
+        mandel_reference(&ref, centre_re, centre_im, c->maxiter);
+        mandel_series(&ref, c->maxiter, step * (c->width / 2), step * (c->height / 2), 1e-9);
+        for(int j = y0; j < y1; j++){
+            mandel_perturb_span(&ref, &p, &s, -step * (c->width / 2), step, step * (j - c->height / 2),
+                                0, c->width, &out[(long) (j - y0) * c->width]);
+        }
+        mandel_reference_free(&ref);
+    }
+
+    double iterations = -s.skipped;
+    *escaped = 0;
+    for(long i = 0; i < (long) (y1 - y0) * c->width; i++){
+        iterations += out[i];
+        *escaped += out[i] < c->maxiter;
+    }
+    return iterations;
+}
+
+/* Runs a case until MIN_TIME has passed and reports it from rank 0 */
+void run(const bench_case_t *c, const char *engine_name, FILE *csv){
+    int y0 = (long) c->height * rank / n_ranks, y1 = (long) c->height * (rank + 1) / n_ranks;
+    int *out = malloc(((long) (y1 - y0) * c->width + 1) * sizeof(int));
+    double elapsed = 0, busy = 0, iterations = 0;
+    long stolen = 0, escaped = 0;
+    int reps = 0;
+
+    /* Every rank does the same number of repetitions, timed by the slowest */
+    while(elapsed < MIN_TIME){
+        MPI_Barrier(MPI_COMM_WORLD);
+        double t = MPI_Wtime();
+        iterations += render(c, y0, y1, out, &stolen, &escaped);
+        t = MPI_Wtime() - t;
+        busy += t;
+        double slowest;
+        MPI_Allreduce(&t, &slowest, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+        elapsed += slowest;
+        reps++;
+    }
+    free(out);
+
+    double total_iterations, max_busy, sum_busy;
+    long total_stolen, total_escaped;
+    MPI_Reduce(&iterations, &total_iterations, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&busy, &max_busy, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&busy, &sum_busy, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&stolen, &total_stolen, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&escaped, &total_escaped, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if(rank != 0){
+        return;
+    }
+
+    double seconds = elapsed / reps;
+    double mpixels = (double) c->width * c->height * reps / elapsed * 1e-6;
+    double miter = total_iterations / elapsed * 1e-6;
+    double imbalance = max_busy / (sum_busy / n_ranks);
+    double escaped_fraction = (double) total_escaped / ((double) c->width * c->height);
+    char size[32];
+    sprintf(size, "%dx%d", c->width, c->height);
+    printf("%-9s %-12s %7d %5d %9s %7d %10.4f %10.2f %10.1f %9.3f\n",
+           c->view->name, engine_name, c->threads, n_ranks,
+           size, c->maxiter,
+           seconds, mpixels, miter, imbalance);
+    if(total_escaped == 0){
+        printf("Warning: no pixel of %s escaped before %d iterations\n", c->view->name, c->maxiter);
+    }
+    fprintf(csv, "%s,%s,%d,%d,%d,%d,%d,%d,%g,%g,%g,%g,%ld,%g\n",
+            c->view->name, engine_name, c->threads, n_ranks, c->width, c->height, c->maxiter,
+            reps, seconds, mpixels, miter, imbalance, total_stolen / reps, escaped_fraction);
+    fflush(csv);
+}
+
+int main( int argc, char **argv ){
+    /* The work stealing threads never call MPI themselves */
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+    if(provided < MPI_THREAD_FUNNELED){
+        if(rank == 0){
+            printf("MPI does not support threads (MPI_THREAD_FUNNELED)\n");
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    const char *csv_name = "mandel_bench.csv";
+    if(argc == 2){
+        csv_name = argv[1];
+    }
+    else if(argc > 2){
+        if(rank == 0){
+            printf("Usage: %s [csv file]\n", argv[0]);
+        }
+        MPI_Finalize();
+        exit(-1);
+    }
+
+    FILE *csv = NULL;
+    int ok = 1;
+    if(rank == 0){
+        csv = fopen(csv_name, "w");
+        ok = csv != NULL;
+        if(!ok){
+            printf("Error opening %s\n", csv_name);
+        }
+    }
+    MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(!ok){
+        MPI_Finalize();
+        exit(-1);
+    }
+
+    /* Threads per rank: powers of two up to the cores each rank has */
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cores / n_ranks > 1 ? cores / n_ranks : 1;
+    const char *best;
+    mandel_span_fn best_kernel = mandel_select("auto", &best);
+    mandel_dd_span_fn best_dd = mandel_dd_select(best);
+
+    if(rank == 0){
+        printf("Ranks: %d, up to %d threads per rank, best kernel %s\n\n", n_ranks, max_threads, best);
+        fprintf(csv, "view,engine,threads,ranks,width,height,maxiter,reps,seconds,mpixels_per_s,miter_per_s,imbalance,stolen,escaped\n");
+        printf("%-9s %-12s %7s %5s %9s %7s %10s %10s %10s %9s\n",
+               "view", "engine", "threads", "ranks", "size", "maxiter",
+               "seconds", "Mpixel/s", "Miter/s", "imbalance");
+    }
+
+    const char *span_names[] = { "scalar", "avx2", "avx512" };
+    char name[32];
+    for(int v = 0; v < N_VIEWS; v++){
+        for(int z = 0; z < N_SIZES; z++){
+            for(int m = 0; m < 2; m++){
+                bench_case_t c = { &views[v], sizes[z][0], sizes[z][1], views[v].maxiter[m],
+                                   ENGINE_SPAN, NULL, NULL, 1 };
+                if(views[v].deep){
+                    if(best_dd){
+                        c.engine = ENGINE_DD;
+                        c.dd_kernel = best_dd;
+                        sprintf(name, "dd-%s", best);
+                        run(&c, name, csv);
+                    }
+                    c.engine = ENGINE_PERTURB;
+                    run(&c, "perturb", csv);
+                    continue;
+                }
+                for(int k = 0; k < 3; k++){
+                    const char *chosen;
+                    c.kernel = mandel_select(span_names[k], &chosen);
+                    if(c.kernel){
+                        run(&c, span_names[k], csv);
+                    }
+                }
+                c.engine = ENGINE_STEAL;
+                c.kernel = best_kernel;
+                for(c.threads = 1; c.threads <= max_threads; c.threads *= 2){
+                    sprintf(name, "steal-%s", best);
+                    run(&c, name, csv);
+                }
+            }
+        }
+    }
+
+    if(rank == 0){
+        fclose(csv);
+        printf("\nWrote %s\n", csv_name);
+    }
+    MPI_Finalize();
+    exit ( EXIT_SUCCESS );
+}
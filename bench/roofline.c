@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <omp.h>
+#include <pthread.h>
+#include <x86intrin.h>
+
+/*
+ * Roofline benchmark for the heat stencil.
+ *
+ * Measures sustainable bandwidth (STREAM triad) and peak single precision
+ * FMA throughput, with the widest vectors the CPU has, on this host, then runs each of the ftcs_solver variants from PS2p2/PS3 on
+ * grids sized to live in L1, L2, L3 and DRAM. For every run the achieved
+ * GFLOP/s is compared against min(peak, AI * bandwidth), where the
+ * bandwidth is the triad bandwidth measured at the same working set size.
+ * Peak and bandwidth are measured with as many threads as the kernel uses,
+ * so the serial kernel is held against a single core's roof.
+ *
+ * Useage: roofline [csv file]
+ * Threads are taken from OMP_NUM_THREADS.
+ */
+
+/* Per cell update: 4 adds, 1 sub, 2 muls */
+const double FLOPS_PER_CELL = 7.0;
+
+/* Per cell update: read in and material, write out */
+const double BYTES_PER_CELL = 12.0;
+
+/* Minimum time spent in each measurement */
+const double MIN_TIME = 0.2;
+
+const int BORDER = 1;
+
+/* Grid state for the stencil variants, sized at run time */
+int grid_size;
+float
+    *material,
+    *temperature[2];
+
+int n_threads = 1;
+
+double walltime(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+// temperature, with border
+int ti(int x, int y){
+    return ((y+(BORDER))*(grid_size+2*(BORDER)) + x + (BORDER));
+}
+
+// material
+int mi(int x, int y){
+    return ((y)*(grid_size) + x );
+}
+
+
+/* ---- Stencil variants, same loops as the assignment solvers ---- */
+
+/* PS2p2/heat_serial.c: x outer, y inner */
+void ftcs_serial( int step ){
+    for(int x = 0; x < grid_size; x++){
+        for(int y = 0; y < grid_size; y++){
+            float* in = temperature[(step)%2];
+            float* out = temperature[(step+1)%2];
+
+            out[ti(x,y)] = in[ti(x,y)] + material[mi(x,y)]*
+                           (in[ti(x+1,y)] +
+                           in[ti(x-1,y)] +
+                           in[ti(x,y+1)] +
+                           in[ti(x,y-1)] -
+                           4*in[ti(x,y)]);
+        }
+    }
+}
+
+/* PS3/openMP/heat_omp.c: flat index split evenly over the team */
+void ftcs_omp( int step ){
+    #pragma omp parallel num_threads(n_threads)
+    {
+        int thisThreadRank = omp_get_thread_num();
+        int numberOfThreads = omp_get_num_threads();
+
+        int whatWeNeedToLoopThru = grid_size*grid_size;
+        int whatEachThreadCanTake = whatWeNeedToLoopThru/numberOfThreads;
+        int start = whatEachThreadCanTake*thisThreadRank;
+        if(thisThreadRank == numberOfThreads-1){
+            whatEachThreadCanTake = whatWeNeedToLoopThru - start;
+        }
+
+        float* in = temperature[(step)%2];
+        float* out = temperature[(step+1)%2];
+
+        for (int i = start; i < (start+whatEachThreadCanTake); ++i){
+            int x = i%grid_size;
+            int y = i/grid_size;
+
+            out[ti(x,y)] = in[ti(x,y)] + material[mi(x,y)]*
+                           (in[ti(x+1,y)] +
+                           in[ti(x-1,y)] +
+                           in[ti(x,y+1)] +
+                           in[ti(x,y-1)] -
+                           4*in[ti(x,y)]);
+        }
+    }
+}
+
+/* PS3/pthreads/heat_pthread.c: threads created and joined every step */
+struct arg_struct {
+    int arg1;
+    int arg2;
+};
+
+void* ftcs_pthread_thread( void *arguments ){
+    struct arg_struct *args = (struct arg_struct *)arguments;
+
+    int thisThreadRank = args->arg1;
+    int step = args->arg2;
+
+    int whatWeNeedToLoopThru = grid_size*grid_size;
+    int whatEachThreadCanTake = whatWeNeedToLoopThru/n_threads;
+    int start = whatEachThreadCanTake*thisThreadRank;
+    if(thisThreadRank == n_threads-1){
+        whatEachThreadCanTake = whatWeNeedToLoopThru - start;
+    }
+
+    float* in = temperature[(step)%2];
+    float* out = temperature[(step+1)%2];
+
+    for (int i = start; i < (start+whatEachThreadCanTake); ++i){
+        int x = i%grid_size;
+        int y = i/grid_size;
+
+        out[ti(x,y)] = in[ti(x,y)] + material[mi(x,y)]*
+                       (in[ti(x+1,y)] +
+                       in[ti(x-1,y)] +
+                       in[ti(x,y+1)] +
+                       in[ti(x,y-1)] -
+                       4*in[ti(x,y)]);
+    }
+    return NULL;
+}
+
+void ftcs_pthread( int step ){
+    struct arg_struct argStrucsArray[n_threads];
+    pthread_t thread_handles[n_threads];
+
+    for (int this_thread = 0; this_thread < n_threads; this_thread++){
+        argStrucsArray[this_thread].arg1 = this_thread;
+        argStrucsArray[this_thread].arg2 = step;
+        pthread_create(&thread_handles[this_thread], NULL, &ftcs_pthread_thread, (void*)&argStrucsArray[this_thread]);
+    }
+    for (int this_thread = 0; this_thread < n_threads; this_thread++){
+        pthread_join(thread_handles[this_thread], NULL);
+    }
+}
+
+/* threads is 1 for serial kernels, 0 for all n_threads */
+struct {
+    const char *name;
+    void (*solver)(int step);
+    int threads;
+} kernels[] = {
+    { "serial", ftcs_serial, 1 },
+    { "openmp", ftcs_omp, 0 },
+    { "pthread", ftcs_pthread, 0 },
+};
+const int N_KERNELS = sizeof(kernels)/sizeof(kernels[0]);
+
+
+/* ---- Machine characterisation ---- */
+
+/* n doubles on a cache line boundary, exits when out of memory */
+double *alloc_doubles(size_t n){
+    void *p;
+    if(posix_memalign(&p, 64, n*sizeof(double)) != 0){
+        printf("Error allocating %zu bytes\n", n*sizeof(double));
+        exit(-1);
+    }
+    return p;
+}
+
+/* Seconds per sweep of a = b + s*c over sweeps sweeps in one parallel
+ * region. Every thread has the same static part in each sweep, so no
+ * barrier is needed between sweeps */
+double triad_sweeps(double *a, const double *b, const double *c, size_t n, int sweeps, int threads){
+    const double s = 3.0;
+    double t = walltime();
+    #pragma omp parallel num_threads(threads)
+    for(int r = 0; r < sweeps; r++){
+        #pragma omp for schedule(static) nowait
+        for(size_t i = 0; i < n; i++){
+            a[i] = b[i] + s*c[i];
+        }
+    }
+    return (walltime() - t)/sweeps;
+}
+
+/* STREAM triad a = b + s*c on n doubles with the given threads, returns GB/s */
+double stream_triad(size_t n, int threads){
+    double *a = alloc_doubles(n);
+    double *b = alloc_doubles(n);
+    double *c = alloc_doubles(n);
+
+    /* First touch in parallel so pages land near the threads using them */
+    #pragma omp parallel for schedule(static) num_threads(threads)
+    for(size_t i = 0; i < n; i++){
+        a[i] = 0.0;
+        b[i] = 1.0;
+        c[i] = 2.0;
+    }
+
+    /* Batches long enough that the one fork and join per batch is noise */
+    int sweeps = 1;
+    while(triad_sweeps(a, b, c, n, sweeps, threads)*sweeps < 1e-3){
+        sweeps *= 2;
+    }
+
+    double best = 1e30;
+    double spent = 0.0;
+    int reps = 0;
+    while(spent < MIN_TIME || reps < 5){
+        double t = triad_sweeps(a, b, c, n, sweeps, threads);
+        spent += t*sweeps;
+        reps++;
+        if(t < best){
+            best = t;
+        }
+    }
+
+    /* Keep the compiler from dropping the sweeps */
+    volatile double sink = a[n/2];
+    (void)sink;
+
+    free(a);
+    free(b);
+    free(c);
+    return 3.0*sizeof(double)*n/best*1e-9;
+}
+
+/* Ten independent single precision FMA chains so the pipelines stay
+ * full, the stencil works on floats */
+__attribute__((target("avx512f")))
+float fma_avx512(long iters){
+    __m512 acc[10];
+    __m512 x = _mm512_set1_ps(0.999999f);
+    __m512 y = _mm512_set1_ps(1e-7f);
+    for(int k = 0; k < 10; k++){
+        acc[k] = _mm512_set1_ps(k);
+    }
+    for(long i = 0; i < iters; i++){
+        for(int k = 0; k < 10; k++){
+            acc[k] = _mm512_fmadd_ps(acc[k], x, y);
+        }
+    }
+    float sum = 0;
+    for(int k = 0; k < 10; k++){
+        sum += _mm512_reduce_add_ps(acc[k]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+float fma_avx2(long iters){
+    __m256 acc[10];
+    __m256 x = _mm256_set1_ps(0.999999f);
+    __m256 y = _mm256_set1_ps(1e-7f);
+    for(int k = 0; k < 10; k++){
+        acc[k] = _mm256_set1_ps(k);
+    }
+    for(long i = 0; i < iters; i++){
+        for(int k = 0; k < 10; k++){
+            acc[k] = _mm256_fmadd_ps(acc[k], x, y);
+        }
+    }
+    float sum = 0;
+    for(int k = 0; k < 10; k++){
+        float v[8];
+        _mm256_storeu_ps(v, acc[k]);
+        for(int l = 0; l < 8; l++){
+            sum += v[l];
+        }
+    }
+    return sum;
+}
+
+float fma_scalar(long iters){
+    float acc[10];
+    for(int k = 0; k < 10; k++){
+        acc[k] = k;
+    }
+    for(long i = 0; i < iters; i++){
+        for(int k = 0; k < 10; k++){
+            acc[k] = acc[k]*0.999999f + 1e-7f;
+        }
+    }
+    float sum = 0;
+    for(int k = 0; k < 10; k++){
+        sum += acc[k];
+    }
+    return sum;
+}
+
+/* Name of the widest FMA the CPU runs, and its single precision lanes */
+const char *fma_isa(double *lanes){
+    if(__builtin_cpu_supports("avx512f")){
+        *lanes = 16.0;
+        return "avx512";
+    }
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        *lanes = 8.0;
+        return "avx2";
+    }
+    *lanes = 1.0;
+    return "scalar";
+}
+
+/* Peak single precision GFLOP/s over the given threads */
+double peak_flops(int threads){
+    double lanes;
+    const char *isa = fma_isa(&lanes);
+    float (*fma)(long) = strcmp(isa, "avx512") == 0 ? fma_avx512 :
+                         strcmp(isa, "avx2") == 0 ? fma_avx2 : fma_scalar;
+    long iters = 1 << 20;
+    double t;
+
+    for(;;){
+        volatile float sink = 0;
+        t = walltime();
+        #pragma omp parallel num_threads(threads)
+        {
+            float r = fma(iters);
+            #pragma omp atomic
+            sink += r;
+        }
+        t = walltime() - t;
+        if(t >= MIN_TIME){
+            break;
+        }
+        iters *= 2;
+    }
+    return threads * iters * 10.0 * lanes * 2.0 / t * 1e-9;
+}
+
+/* Cache sizes in bytes, with fallbacks when sysconf does not know */
+long cache_size(int level){
+    long s = -1;
+    switch(level){
+        case 1: s = sysconf(_SC_LEVEL1_DCACHE_SIZE); break;
+        case 2: s = sysconf(_SC_LEVEL2_CACHE_SIZE); break;
+        case 3: s = sysconf(_SC_LEVEL3_CACHE_SIZE); break;
+    }
+    if(s <= 0){
+        const long fallback[] = { 0, 32L<<10, 1L<<20, 16L<<20 };
+        s = fallback[level];
+    }
+    return s;
+}
+
+
+/* ---- Stencil runs ---- */
+
+void init_grid(){
+    size_t temperature_size = (grid_size+2*BORDER)*(size_t)(grid_size+2*BORDER);
+    temperature[0] = malloc(temperature_size*sizeof(float));
+    temperature[1] = malloc(temperature_size*sizeof(float));
+    material = malloc((size_t)grid_size*grid_size*sizeof(float));
+
+    for(size_t i = 0; i < temperature_size; i++){
+        temperature[0][i] = 10.0;
+        temperature[1][i] = 10.0;
+    }
+    for(int y = 0; y < grid_size; y++){
+        for(int x = 0; x < grid_size; x++){
+            material[mi(x,y)] = 0.0619 * (2.5e-3/(5e-2*5e-2));
+            temperature[0][ti(x,y)] = 20.0;
+        }
+    }
+}
+
+void free_grid(){
+    free(temperature[0]);
+    free(temperature[1]);
+    free(material);
+}
+
+/* Seconds per step for one solver, best of several batches */
+double time_solver(void (*solver)(int)){
+    int steps = 1;
+    double t;
+
+    /* Warm up caches and the thread pool */
+    solver(0);
+    solver(1);
+
+    for(;;){
+        t = walltime();
+        for(int step = 0; step < steps; step++){
+            solver(step);
+        }
+        t = walltime() - t;
+        if(t >= MIN_TIME){
+            break;
+        }
+        steps *= 2;
+    }
+
+    double best = t/steps;
+    for(int rep = 0; rep < 2; rep++){
+        t = walltime();
+        for(int step = 0; step < steps; step++){
+            solver(step);
+        }
+        t = (walltime() - t)/steps;
+        if(t < best){
+            best = t;
+        }
+    }
+    return best;
+}
+
+int main( int argc, char **argv ){
+    const char *csv_name = "roofline.csv";
+    if(argc == 2){
+        csv_name = argv[1];
+    }
+    else if(argc > 2){
+        printf("Useage: %s [csv file]\n", argv[0]);
+        exit(-1);
+    }
+    n_threads = omp_get_max_threads();
+
+    FILE *csv = fopen(csv_name, "w");
+    if(!csv){
+        printf("Error opening %s\n", csv_name);
+        exit(-1);
+    }
+
+    printf("Threads: %d\n", n_threads);
+    /* Index 0 is one thread, index 1 all n_threads */
+    double peak[2];
+    peak[0] = peak_flops(1);
+    peak[1] = n_threads > 1 ? peak_flops(n_threads) : peak[0];
+    double lanes;
+    printf("Peak single precision FMA (%s): %.2f GFLOP/s on 1 thread, %.2f GFLOP/s on %d\n",
+           fma_isa(&lanes), peak[0], peak[1], n_threads);
+
+    /* Working sets at half of each cache, and four times the last level */
+    const char *level_name[] = { "L1", "L2", "L3", "DRAM" };
+    long working_set[4];
+    working_set[0] = cache_size(1)/2;
+    working_set[1] = cache_size(2)/2;
+    working_set[2] = cache_size(3)/2;
+    working_set[3] = cache_size(3)*4;
+    if(working_set[3] < (256L<<20)){
+        working_set[3] = 256L<<20;
+    }
+
+    double ai = FLOPS_PER_CELL/BYTES_PER_CELL;
+    printf("Arithmetic intensity: %.3f flop/byte\n\n", ai);
+
+    fprintf(csv, "level,working_set_bytes,kernel,threads,grid,seconds_per_step,gflops,gbytes,ai,bandwidth,peak,roof,fraction\n");
+    printf("%-5s %-8s %7s %6s %10s %10s %10s %10s %8s\n",
+           "level", "kernel", "threads", "grid", "GFLOP/s", "GB/s", "BW GB/s", "roof", "fraction");
+
+    for(int level = 0; level < 4; level++){
+        /* Triad on three arrays with the same footprint as the grid */
+        size_t triad_n = working_set[level]/(3*sizeof(double));
+        double bandwidth[2];
+        bandwidth[0] = stream_triad(triad_n, 1);
+        bandwidth[1] = n_threads > 1 ? stream_triad(triad_n, n_threads) : bandwidth[0];
+
+        grid_size = (int)sqrt(working_set[level]/BYTES_PER_CELL);
+        if(grid_size < 16){
+            grid_size = 16;
+        }
+        init_grid();
+        double cells = (double)grid_size*grid_size;
+
+        for(int k = 0; k < N_KERNELS; k++){
+            double t = time_solver(kernels[k].solver);
+            double gflops = FLOPS_PER_CELL*cells/t*1e-9;
+            double gbytes = BYTES_PER_CELL*cells/t*1e-9;
+            int threads = kernels[k].threads ? kernels[k].threads : n_threads;
+            int w = threads > 1;
+            double roof = fmin(peak[w], ai*bandwidth[w]);
+
+            printf("%-5s %-8s %7d %6d %10.2f %10.2f %10.2f %10.2f %7.1f%%\n",
+                   level_name[level], kernels[k].name, threads, grid_size, gflops, gbytes,
+                   bandwidth[w], roof, 100.0*gflops/roof);
+            fprintf(csv, "%s,%ld,%s,%d,%d,%g,%g,%g,%g,%g,%g,%g,%g\n",
+                    level_name[level], working_set[level], kernels[k].name, threads,
+                    grid_size, t, gflops, gbytes, ai, bandwidth[w], peak[w], roof, gflops/roof);
+        }
+        free_grid();
+    }
+
+    fclose(csv);
+    printf("\nWrote %s\n", csv_name);
+    exit ( EXIT_SUCCESS );
+}
@@ -0,0 +1,77 @@
+/*
+ * 24 bit BMP output shared by the programs that write images, and the
+ * colour map of the heat equation solvers.
+ *
+ * Images are given as x*3 bytes per row, bottom row first, as the file
+ * stores them. Width and height are written as full 32 bit fields and
+ * rows are padded to 4 bytes in the file, so any size reads back square.
+ */
+#ifndef BMP_H
+#define BMP_H
+
+#include <stdio.h>
+#include <string.h>
+
+/* The 54 byte header of an x by y image */
+static void bmp_header(unsigned char *header, int x, int y){
+    unsigned long row_bytes = ((unsigned long)x * 3 + 3) & ~3UL;
+    unsigned long size = row_bytes * y + 54;
+    /* Sizes past 4 GB do not fit, readers go by width and height then */
+    if(size > 0xffffffffUL){
+        size = 0;
+    }
+    const unsigned char fields[54] = {'B', 'M',
+                                      size&255, (size >> 8)&255, (size >> 16)&255, (size >> 24)&255,
+                                      0, 0, 0, 0, 54, 0, 0, 0, 40, 0, 0, 0,
+                                      x&255, (x >> 8)&255, (x >> 16)&255, (x >> 24)&255,
+                                      y&255, (y >> 8)&255, (y >> 16)&255, (y >> 24)&255,
+                                      1, 0, 24, 0, 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    memcpy(header, fields, 54);
+}
+
+/* Writes buffer to name, returns 0 if the file could not be written */
+static int bmp_save(const char *name, const unsigned char *buffer, int x, int y){
+    FILE *f = fopen(name, "wb");
+    if(!f){
+        printf("Error writing image to disk.\n");
+        return 0;
+    }
+    unsigned char header[54];
+    bmp_header(header, x, y);
+    fwrite(header, 1, 54, f);
+    const unsigned char pad[3] = { 0, 0, 0 };
+    size_t row_bytes = (size_t)x * 3;
+    for(int j = 0; j < y; j++){
+        fwrite(buffer + row_bytes * j, 1, row_bytes, f);
+        fwrite(pad, 1, (4 - row_bytes % 4) % 4, f);
+    }
+    fclose(f);
+    return 1;
+}
+
+/* Blue through cyan, green and yellow to red for 0 to 100 degrees */
+static void bmp_heat_colour(unsigned char *p, float temp){
+    if(temp <= 25){
+        p[2] = 0;
+        p[1] = (unsigned char)((temp/25)*255);
+        p[0] = 255;
+    }
+    else if (temp <= 50){
+        p[2] = 0;
+        p[1] = 255;
+        p[0] = 255 - (unsigned char)(((temp-25)/25) * 255);
+    }
+    else if (temp <= 75){
+        p[2] = (unsigned char)(255* (temp-50)/25);
+        p[1] = 255;
+        p[0] = 0;
+    }
+    else{
+        p[2] = 255;
+        p[1] = 255 -(unsigned char)(255* (temp-75)/25) ;
+        p[0] = 0;
+    }
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Double-double arithmetic: a value is the unevaluated sum hi + lo of two
+ * doubles with |lo| <= ulp(hi)/2, which gives about 106 bits (32 decimal
+ * digits) of mantissa. Built on the error free transforms two_sum and
+ * two_prod, the latter using fma().
+ */
+#ifndef DD_H
+#define DD_H
+
+#include <math.h>
+#include <ctype.h>
+#include <stdlib.h>
+
+typedef struct {
+    double hi, lo;
+} dd_t;
+
+static inline dd_t dd_from(double a){
+    return (dd_t){ a, 0.0 };
+}
+
+/* a + b exactly, when |a| >= |b| */
+static inline dd_t dd_quick_two_sum(double a, double b){
+    double s = a + b;
+    return (dd_t){ s, b - (s - a) };
+}
+
+/* a + b exactly */
+static inline dd_t dd_two_sum(double a, double b){
+    double s = a + b;
+    double bb = s - a;
+    return (dd_t){ s, (a - (s - bb)) + (b - bb) };
+}
+
+/* a * b exactly */
+static inline dd_t dd_two_prod(double a, double b){
+    double p = a * b;
+    return (dd_t){ p, fma(a, b, -p) };
+}
+
+static inline dd_t dd_add(dd_t a, dd_t b){
+    dd_t s = dd_two_sum(a.hi, b.hi);
+    dd_t t = dd_two_sum(a.lo, b.lo);
+    s.lo += t.hi;
+    s = dd_quick_two_sum(s.hi, s.lo);
+    s.lo += t.lo;
+    return dd_quick_two_sum(s.hi, s.lo);
+}
+
+static inline dd_t dd_neg(dd_t a){
+    return (dd_t){ -a.hi, -a.lo };
+}
+
+static inline dd_t dd_sub(dd_t a, dd_t b){
+    return dd_add(a, dd_neg(b));
+}
+
+static inline dd_t dd_mul(dd_t a, dd_t b){
+    dd_t p = dd_two_prod(a.hi, b.hi);
+    p.lo += a.hi * b.lo + a.lo * b.hi;
+    return dd_quick_two_sum(p.hi, p.lo);
+}
+
+static inline dd_t dd_mul_d(dd_t a, double b){
+    dd_t p = dd_two_prod(a.hi, b);
+    p.lo += a.lo * b;
+    return dd_quick_two_sum(p.hi, p.lo);
+}
+
+static inline dd_t dd_div_d(dd_t a, double b){
+    double q1 = a.hi / b;
+    dd_t r = dd_sub(a, dd_two_prod(q1, b));
+    return dd_quick_two_sum(q1, r.hi / b);
+}
+
+/* Decimal string such as "-0.7436438870371587522" or "1.5e-20" to
+ * double-double, keeping the digits a plain strtod would round away.
+ * Returns the number of characters used, 0 if there was no number.
+ */
+static int dd_parse(const char *str, dd_t *out){
+    const char *s = str;
+    int negative = 0, digits = 0, exponent = 0;
+    dd_t r = dd_from(0.0);
+
+    if(*s == '-' || *s == '+'){
+        negative = *s == '-';
+        s++;
+    }
+    for(; isdigit((unsigned char) *s); s++, digits++){
+        r = dd_add(dd_mul_d(r, 10.0), dd_from(*s - '0'));
+    }
+    if(*s == '.'){
+        for(s++; isdigit((unsigned char) *s); s++, digits++){
+            r = dd_add(dd_mul_d(r, 10.0), dd_from(*s - '0'));
+            exponent--;
+        }
+    }
+    if(digits == 0){
+        return 0;
+    }
+    if(*s == 'e' || *s == 'E'){
+        char *end;
+        exponent += (int) strtol(s + 1, &end, 10);
+        s = end;
+    }
+    for(; exponent > 0; exponent--){
+        r = dd_mul_d(r, 10.0);
+    }
+    for(; exponent < 0; exponent++){
+        r = dd_div_d(r, 10.0);
+    }
+    *out = negative ? dd_neg(r) : r;
+    return (int) (s - str);
+}
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Escape time kernels in double-double (dd.h) for zooms where double
+ * runs out of bits but the image is not yet deep enough for the
+ * perturbation renderer to pay for its reference orbit.
+ *
+ * Pixel k of a span has c = (x0 + step*(i0+k)) + ci*i with x0 and ci in
+ * double-double, so the view centre keeps all its digits. z and c are
+ * carried as hi + lo pairs through the error free transforms two_sum and
+ * two_prod (FMA). The vector kernels run 4 (AVX2 + FMA) or 8 (AVX-512)
+ * pixels side by side with the same lane masking as mandel_kernel.h, and
+ * do the same operations in the same order as the scalar loop, so all
+ * three give identical images. The escape test uses the hi parts only.
+ */
+#ifndef MANDEL_DD_H
+#define MANDEL_DD_H
+
+#include <string.h>
+#include <x86intrin.h>
+
+#include "dd.h"
+#include "mandel_kernel.h"
+
+typedef void (*mandel_dd_span_fn)(const mandel_params_t *p, mandel_stats_t *s,
+                                  dd_t x0, double step, dd_t ci, int i0, int n, int *out);
+
+static void mandel_dd_span_scalar(const mandel_params_t *p, mandel_stats_t *s,
+                                  dd_t x0, double step, dd_t ci, int i0, int n, int *out){
+    for(int k = 0; k < n; k++){
+        dd_t cr = dd_add(x0, dd_from(step * (i0 + k)));
+        dd_t zr = cr, zi = ci;
+        int iter = 0;
+        while(zr.hi * zr.hi + zi.hi * zi.hi < 4){
+            dd_t zri = dd_mul(zr, zi);
+            zr = dd_add(dd_sub(dd_mul(zr, zr), dd_mul(zi, zi)), cr);
+            zi = dd_add((dd_t){ 2 * zri.hi, 2 * zri.lo }, ci);
+            iter++;
+            if(iter == p->maxiter){
+                break;
+            }
+        }
+        out[k] = iter;
+    }
+}
+
+/* Four double-doubles, one per lane */
+typedef struct {
+    __m256d hi, lo;
+} dd4_t;
+
+__attribute__((target("avx2,fma")))
+static inline dd4_t dd4_quick_two_sum(__m256d a, __m256d b){
+    __m256d s = _mm256_add_pd(a, b);
+    return (dd4_t){ s, _mm256_sub_pd(b, _mm256_sub_pd(s, a)) };
+}
+
+__attribute__((target("avx2,fma")))
+static inline dd4_t dd4_two_sum(__m256d a, __m256d b){
+    __m256d s = _mm256_add_pd(a, b);
+    __m256d bb = _mm256_sub_pd(s, a);
+    __m256d e = _mm256_add_pd(_mm256_sub_pd(a, _mm256_sub_pd(s, bb)), _mm256_sub_pd(b, bb));
+    return (dd4_t){ s, e };
+}
+
+__attribute__((target("avx2,fma")))
+static inline dd4_t dd4_add(dd4_t a, dd4_t b){
+    dd4_t s = dd4_two_sum(a.hi, b.hi);
+    dd4_t t = dd4_two_sum(a.lo, b.lo);
+    s = dd4_quick_two_sum(s.hi, _mm256_add_pd(s.lo, t.hi));
+    return dd4_quick_two_sum(s.hi, _mm256_add_pd(s.lo, t.lo));
+}
+
+__attribute__((target("avx2,fma")))
+static inline dd4_t dd4_sub(dd4_t a, dd4_t b){
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    return dd4_add(a, (dd4_t){ _mm256_xor_pd(b.hi, sign), _mm256_xor_pd(b.lo, sign) });
+}
+
+__attribute__((target("avx2,fma")))
+static inline dd4_t dd4_mul(dd4_t a, dd4_t b){
+    __m256d p = _mm256_mul_pd(a.hi, b.hi);
+    __m256d e = _mm256_fmadd_pd(a.hi, b.hi, _mm256_xor_pd(p, _mm256_set1_pd(-0.0)));
+    e = _mm256_add_pd(e, _mm256_add_pd(_mm256_mul_pd(a.hi, b.lo), _mm256_mul_pd(a.lo, b.hi)));
+    return dd4_quick_two_sum(p, e);
+}
+
+__attribute__((target("avx2,fma")))
+static void mandel_dd_span_avx2(const mandel_params_t *p, mandel_stats_t *s,
+                                dd_t x0, double step, dd_t ci, int i0, int n, int *out){
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const dd4_t vci = { _mm256_set1_pd(ci.hi), _mm256_set1_pd(ci.lo) };
+
+    for(int k = 0; k < n; k += 4){
+        /* Lanes past the end of the span repeat the last pixel */
+        double chi[4], clo[4];
+        for(int l = 0; l < 4; l++){
+            int idx = k + l < n ? k + l : n - 1;
+            dd_t c = dd_add(x0, dd_from(step * (i0 + idx)));
+            chi[l] = c.hi;
+            clo[l] = c.lo;
+        }
+        dd4_t cr = { _mm256_loadu_pd(chi), _mm256_loadu_pd(clo) };
+        dd4_t zr = cr, zi = vci;
+        __m256i count = _mm256_setzero_si256();
+
+        for(int iter = 0; iter < p->maxiter; iter++){
+            __m256d mag = _mm256_add_pd(_mm256_mul_pd(zr.hi, zr.hi), _mm256_mul_pd(zi.hi, zi.hi));
+            __m256d active = _mm256_cmp_pd(mag, four, _CMP_LT_OQ);
+            if(_mm256_movemask_pd(active) == 0){
+                break;
+            }
+            dd4_t zri = dd4_mul(zr, zi);
+            dd4_t tr = dd4_add(dd4_sub(dd4_mul(zr, zr), dd4_mul(zi, zi)), cr);
+            dd4_t ti = dd4_add((dd4_t){ _mm256_mul_pd(two, zri.hi), _mm256_mul_pd(two, zri.lo) }, vci);
+            zr.hi = _mm256_blendv_pd(zr.hi, tr.hi, active);
+            zr.lo = _mm256_blendv_pd(zr.lo, tr.lo, active);
+            zi.hi = _mm256_blendv_pd(zi.hi, ti.hi, active);
+            zi.lo = _mm256_blendv_pd(zi.lo, ti.lo, active);
+            count = _mm256_sub_epi64(count, _mm256_castpd_si256(active));
+        }
+
+        long long counts[4];
+        _mm256_storeu_si256((__m256i*) counts, count);
+        for(int l = 0; l < 4 && k + l < n; l++){
+            out[k + l] = (int) counts[l];
+        }
+    }
+}
+
+/* Eight double-doubles, one per lane */
+typedef struct {
+    __m512d hi, lo;
+} dd8_t;
+
+__attribute__((target("avx512f")))
+static inline dd8_t dd8_quick_two_sum(__m512d a, __m512d b){
+    __m512d s = _mm512_add_pd(a, b);
+    return (dd8_t){ s, _mm512_sub_pd(b, _mm512_sub_pd(s, a)) };
+}
+
+__attribute__((target("avx512f")))
+static inline dd8_t dd8_two_sum(__m512d a, __m512d b){
+    __m512d s = _mm512_add_pd(a, b);
+    __m512d bb = _mm512_sub_pd(s, a);
+    __m512d e = _mm512_add_pd(_mm512_sub_pd(a, _mm512_sub_pd(s, bb)), _mm512_sub_pd(b, bb));
+    return (dd8_t){ s, e };
+}
+
+__attribute__((target("avx512f")))
+static inline dd8_t dd8_add(dd8_t a, dd8_t b){
+    dd8_t s = dd8_two_sum(a.hi, b.hi);
+    dd8_t t = dd8_two_sum(a.lo, b.lo);
+    s = dd8_quick_two_sum(s.hi, _mm512_add_pd(s.lo, t.hi));
+    return dd8_quick_two_sum(s.hi, _mm512_add_pd(s.lo, t.lo));
+}
+
+__attribute__((target("avx512f")))
+static inline dd8_t dd8_sub(dd8_t a, dd8_t b){
+    /* Flip the sign bits, AVX-512F has no floating point xor */
+    const __m512i sign = _mm512_set1_epi64(0x8000000000000000LL);
+    __m512d nhi = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(b.hi), sign));
+    __m512d nlo = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(b.lo), sign));
+    return dd8_add(a, (dd8_t){ nhi, nlo });
+}
+
+__attribute__((target("avx512f")))
+static inline dd8_t dd8_mul(dd8_t a, dd8_t b){
+    __m512d p = _mm512_mul_pd(a.hi, b.hi);
+    __m512d e = _mm512_fmsub_pd(a.hi, b.hi, p);
+    e = _mm512_add_pd(e, _mm512_add_pd(_mm512_mul_pd(a.hi, b.lo), _mm512_mul_pd(a.lo, b.hi)));
+    return dd8_quick_two_sum(p, e);
+}
+
+__attribute__((target("avx512f")))
+static void mandel_dd_span_avx512(const mandel_params_t *p, mandel_stats_t *s,
+                                  dd_t x0, double step, dd_t ci, int i0, int n, int *out){
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512i one = _mm512_set1_epi64(1);
+    const dd8_t vci = { _mm512_set1_pd(ci.hi), _mm512_set1_pd(ci.lo) };
+
+    for(int k = 0; k < n; k += 8){
+        double chi[8], clo[8];
+        for(int l = 0; l < 8; l++){
+            int idx = k + l < n ? k + l : n - 1;
+            dd_t c = dd_add(x0, dd_from(step * (i0 + idx)));
+            chi[l] = c.hi;
+            clo[l] = c.lo;
+        }
+        dd8_t cr = { _mm512_loadu_pd(chi), _mm512_loadu_pd(clo) };
+        dd8_t zr = cr, zi = vci;
+        __m512i count = _mm512_setzero_si512();
+
+        for(int iter = 0; iter < p->maxiter; iter++){
+            __m512d mag = _mm512_add_pd(_mm512_mul_pd(zr.hi, zr.hi), _mm512_mul_pd(zi.hi, zi.hi));
+            __mmask8 active = _mm512_cmp_pd_mask(mag, four, _CMP_LT_OQ);
+            if(active == 0){
+                break;
+            }
+            dd8_t zri = dd8_mul(zr, zi);
+            dd8_t tr = dd8_add(dd8_sub(dd8_mul(zr, zr), dd8_mul(zi, zi)), cr);
+            dd8_t ti = dd8_add((dd8_t){ _mm512_mul_pd(two, zri.hi), _mm512_mul_pd(two, zri.lo) }, vci);
+            zr.hi = _mm512_mask_mov_pd(zr.hi, active, tr.hi);
+            zr.lo = _mm512_mask_mov_pd(zr.lo, active, tr.lo);
+            zi.hi = _mm512_mask_mov_pd(zi.hi, active, ti.hi);
+            zi.lo = _mm512_mask_mov_pd(zi.lo, active, ti.lo);
+            count = _mm512_mask_add_epi64(count, active, count, one);
+        }
+
+        long long counts[8];
+        _mm512_storeu_si512(counts, count);
+        for(int l = 0; l < 8 && k + l < n; l++){
+            out[k + l] = (int) counts[l];
+        }
+    }
+}
+
+/* Double-double kernel by the same names as mandel_select, or NULL */
+static mandel_dd_span_fn mandel_dd_select(const char *name){
+    if(strcmp(name, "scalar") == 0){
+        return mandel_dd_span_scalar;
+    }
+    if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        return mandel_dd_span_avx2;
+    }
+    if(strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f")){
+        return mandel_dd_span_avx512;
+    }
+    return NULL;
+}
+
+#endif
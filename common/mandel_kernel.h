@@ -0,0 +1,367 @@
+/*
+ * Escape time kernels for the Mandelbrot programs.
+ *
+ * A kernel computes the iteration counts for n neighbouring pixels of one
+ * row: pixel k has c = (x0 + step*(i0+k)) + ci*i. The vector kernels run
+ * 4 (AVX2) or 8 (AVX-512) pixels side by side. Lanes that have escaped
+ * are frozen with compare and blend, and the vector leaves the loop when
+ * every lane has escaped or reached maxiter.
+ *
+ * With cull set, points inside the main cardioid or the period-2 bulb are
+ * recognised in closed form and given maxiter without iterating.
+ *
+ * With period_eps > 0 the orbit is checked for cycles the way Brent's
+ * algorithm does: z is saved after 1, 2, 4, 8, ... iterations, and a point
+ * whose z comes back within period_eps (in both parts) of the saved value
+ * is taken to be interior and given maxiter.
+ *
+ * All kernels do the same floating point operations in the same order as
+ * the scalar loop (no FMA), so they give identical images.
+ *
+ * Pick a kernel once at startup with mandel_select().
+ */
+#ifndef MANDEL_KERNEL_H
+#define MANDEL_KERNEL_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <x86intrin.h>
+
+typedef struct {
+    int maxiter;
+    int cull;
+    double period_eps;
+} mandel_params_t;
+
+/* Counters a kernel adds to. skipped is the number of iterations the
+ * culled, periodic and filled pixels were credited with but never ran.
+ * filled is counted by mandel_subdivide in mandel_rect.h and rebased by
+ * the perturbation renderer in mandel_perturb.h.
+ */
+typedef struct {
+    long culled;
+    long periodic;
+    long filled;
+    long rebased;
+    double skipped;
+} mandel_stats_t;
+
+typedef void (*mandel_span_fn)(const mandel_params_t *p, mandel_stats_t *s,
+                               double x0, double step, double ci, int i0, int n, int *out);
+
+/* Inside the main cardioid or the period-2 bulb around -1 */
+static inline int mandel_culled(double cr, double ci){
+    double xq = cr - 0.25;
+    double q = xq * xq + ci * ci;
+    if(q * (q + xq) <= 0.25 * (ci * ci)){
+        return 1;
+    }
+    return (cr + 1) * (cr + 1) + ci * ci <= 0.0625;
+}
+
+static void mandel_span_scalar(const mandel_params_t *p, mandel_stats_t *s,
+                               double x0, double step, double ci, int i0, int n, int *out){
+    for(int k = 0; k < n; k++){
+        double cr = x0 + step * (i0 + k);
+        if(p->cull && mandel_culled(cr, ci)){
+            out[k] = p->maxiter;
+            s->culled++;
+            s->skipped += p->maxiter;
+            continue;
+        }
+        double zr = cr, zi = ci;
+        double sr = zr, si = zi;
+        int iter = 0, next = 1;
+        while(zr * zr + zi * zi < 4){
+            double tr = zr * zr - zi * zi + cr;
+            double ti = 2 * zr * zi + ci;
+            zr = tr;
+            zi = ti;
+            iter++;
+            if(iter == p->maxiter){
+                break;
+            }
+            if(p->period_eps > 0){
+                if(fabs(zr - sr) < p->period_eps && fabs(zi - si) < p->period_eps){
+                    s->periodic++;
+                    s->skipped += p->maxiter - iter;
+                    iter = p->maxiter;
+                    break;
+                }
+                if(iter == next){
+                    sr = zr;
+                    si = zi;
+                    next *= 2;
+                }
+            }
+        }
+        out[k] = iter;
+    }
+}
+
+__attribute__((target("avx2")))
+static void mandel_span_avx2(const mandel_params_t *p, mandel_stats_t *s,
+                             double x0, double step, double ci, int i0, int n, int *out){
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d vci = _mm256_set1_pd(ci);
+    const __m256d ci2 = _mm256_set1_pd(ci * ci);
+    const __m256d quarter = _mm256_set1_pd(0.25);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d sixteenth = _mm256_set1_pd(0.0625);
+    const __m256d eps = _mm256_set1_pd(p->period_eps);
+    const __m256d sign = _mm256_set1_pd(-0.0);
+
+    for(int k = 0; k < n; k += 4){
+        /* Lanes past the end of the span repeat the last pixel */
+        double c[4];
+        for(int l = 0; l < 4; l++){
+            int idx = k + l < n ? k + l : n - 1;
+            c[l] = x0 + step * (i0 + idx);
+        }
+        __m256d cr = _mm256_loadu_pd(c);
+        __m256d zr = cr, zi = vci;
+        __m256i count = _mm256_setzero_si256();
+
+        /* Culled lanes never become active */
+        __m256d live = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        int culled = 0;
+        if(p->cull){
+            __m256d xq = _mm256_sub_pd(cr, quarter);
+            __m256d q = _mm256_add_pd(_mm256_mul_pd(xq, xq), ci2);
+            __m256d cardioid = _mm256_cmp_pd(_mm256_mul_pd(q, _mm256_add_pd(q, xq)),
+                                             _mm256_mul_pd(quarter, ci2), _CMP_LE_OQ);
+            __m256d xb = _mm256_add_pd(cr, one);
+            __m256d bulb = _mm256_cmp_pd(_mm256_add_pd(_mm256_mul_pd(xb, xb), ci2),
+                                         sixteenth, _CMP_LE_OQ);
+            culled = _mm256_movemask_pd(_mm256_or_pd(cardioid, bulb));
+            live = _mm256_andnot_pd(_mm256_or_pd(cardioid, bulb), live);
+        }
+
+        /* Saved orbit point and lanes found periodic */
+        __m256d sr = zr, si = zi;
+        __m256d periodic = _mm256_setzero_pd();
+        int next = 1;
+
+        for(int iter = 0; iter < p->maxiter; iter++){
+            __m256d zr2 = _mm256_mul_pd(zr, zr);
+            __m256d zi2 = _mm256_mul_pd(zi, zi);
+            __m256d active = _mm256_and_pd(live,
+                _mm256_cmp_pd(_mm256_add_pd(zr2, zi2), four, _CMP_LT_OQ));
+            if(_mm256_movemask_pd(active) == 0){
+                break;
+            }
+            __m256d tr = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), cr);
+            __m256d ti = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, zr), zi), vci);
+            zr = _mm256_blendv_pd(zr, tr, active);
+            zi = _mm256_blendv_pd(zi, ti, active);
+            /* active lanes are all ones, i.e. -1 */
+            count = _mm256_sub_epi64(count, _mm256_castpd_si256(active));
+
+            if(p->period_eps > 0 && iter + 1 < p->maxiter){
+                __m256d dr = _mm256_andnot_pd(sign, _mm256_sub_pd(zr, sr));
+                __m256d di = _mm256_andnot_pd(sign, _mm256_sub_pd(zi, si));
+                __m256d cycle = _mm256_and_pd(active, _mm256_and_pd(
+                    _mm256_cmp_pd(dr, eps, _CMP_LT_OQ), _mm256_cmp_pd(di, eps, _CMP_LT_OQ)));
+                periodic = _mm256_or_pd(periodic, cycle);
+                live = _mm256_andnot_pd(cycle, live);
+                if(iter + 1 == next){
+                    sr = zr;
+                    si = zi;
+                    next *= 2;
+                }
+            }
+        }
+        int cycled = _mm256_movemask_pd(periodic);
+
+        long long counts[4];
+        _mm256_storeu_si256((__m256i*) counts, count);
+        for(int l = 0; l < 4 && k + l < n; l++){
+            if(culled & (1 << l)){
+                out[k + l] = p->maxiter;
+                s->culled++;
+                s->skipped += p->maxiter;
+            }
+            else if(cycled & (1 << l)){
+                out[k + l] = p->maxiter;
+                s->periodic++;
+                s->skipped += p->maxiter - counts[l];
+            }
+            else{
+                out[k + l] = (int) counts[l];
+            }
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void mandel_span_avx512(const mandel_params_t *p, mandel_stats_t *s,
+                               double x0, double step, double ci, int i0, int n, int *out){
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512d vci = _mm512_set1_pd(ci);
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512d ci2 = _mm512_set1_pd(ci * ci);
+    const __m512d quarter = _mm512_set1_pd(0.25);
+    const __m512d onepd = _mm512_set1_pd(1.0);
+    const __m512d sixteenth = _mm512_set1_pd(0.0625);
+    const __m512d eps = _mm512_set1_pd(p->period_eps);
+
+    for(int k = 0; k < n; k += 8){
+        double c[8];
+        for(int l = 0; l < 8; l++){
+            int idx = k + l < n ? k + l : n - 1;
+            c[l] = x0 + step * (i0 + idx);
+        }
+        __m512d cr = _mm512_loadu_pd(c);
+        __m512d zr = cr, zi = vci;
+        __m512i count = _mm512_setzero_si512();
+
+        /* Culled lanes never become active */
+        __mmask8 culled = 0;
+        if(p->cull){
+            __m512d xq = _mm512_sub_pd(cr, quarter);
+            __m512d q = _mm512_add_pd(_mm512_mul_pd(xq, xq), ci2);
+            culled = _mm512_cmp_pd_mask(_mm512_mul_pd(q, _mm512_add_pd(q, xq)),
+                                        _mm512_mul_pd(quarter, ci2), _CMP_LE_OQ);
+            __m512d xb = _mm512_add_pd(cr, onepd);
+            culled |= _mm512_cmp_pd_mask(_mm512_add_pd(_mm512_mul_pd(xb, xb), ci2),
+                                         sixteenth, _CMP_LE_OQ);
+        }
+        __mmask8 live = ~culled;
+
+        /* Saved orbit point and lanes found periodic */
+        __m512d sr = zr, si = zi;
+        __mmask8 cycled = 0;
+        int next = 1;
+
+        for(int iter = 0; iter < p->maxiter; iter++){
+            __m512d zr2 = _mm512_mul_pd(zr, zr);
+            __m512d zi2 = _mm512_mul_pd(zi, zi);
+            __mmask8 active = _mm512_mask_cmp_pd_mask(live, _mm512_add_pd(zr2, zi2), four, _CMP_LT_OQ);
+            if(active == 0){
+                break;
+            }
+            __m512d tr = _mm512_add_pd(_mm512_sub_pd(zr2, zi2), cr);
+            __m512d ti = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two, zr), zi), vci);
+            zr = _mm512_mask_mov_pd(zr, active, tr);
+            zi = _mm512_mask_mov_pd(zi, active, ti);
+            count = _mm512_mask_add_epi64(count, active, count, one);
+
+            if(p->period_eps > 0 && iter + 1 < p->maxiter){
+                __m512d dr = _mm512_abs_pd(_mm512_sub_pd(zr, sr));
+                __m512d di = _mm512_abs_pd(_mm512_sub_pd(zi, si));
+                __mmask8 cycle = _mm512_mask_cmp_pd_mask(active, dr, eps, _CMP_LT_OQ);
+                cycle = _mm512_mask_cmp_pd_mask(cycle, di, eps, _CMP_LT_OQ);
+                cycled |= cycle;
+                live &= ~cycle;
+                if(iter + 1 == next){
+                    sr = zr;
+                    si = zi;
+                    next *= 2;
+                }
+            }
+        }
+
+        long long counts[8];
+        _mm512_storeu_si512(counts, count);
+        for(int l = 0; l < 8 && k + l < n; l++){
+            if(culled & (1 << l)){
+                out[k + l] = p->maxiter;
+                s->culled++;
+                s->skipped += p->maxiter;
+            }
+            else if(cycled & (1 << l)){
+                out[k + l] = p->maxiter;
+                s->periodic++;
+                s->skipped += p->maxiter - counts[l];
+            }
+            else{
+                out[k + l] = (int) counts[l];
+            }
+        }
+    }
+}
+
+/* State of a pixel's orbit, for iterating it further later */
+typedef struct {
+    int index;
+    int iter;
+    double zr, zi;
+} mandel_orbit_t;
+
+/* Continues orbit o of c = cr + ci*i until it escapes or reaches maxiter,
+ * with the same operations as the kernels. Returns 1 if it escaped.
+ * Stopping at one maxiter and continuing to a higher one gives the same
+ * count as going to the higher one in one go.
+ */
+static inline int mandel_continue(mandel_orbit_t *o, double cr, double ci, int maxiter){
+    double zr = o->zr, zi = o->zi;
+    int iter = o->iter;
+    int escaped = 1;
+    while(zr * zr + zi * zi < 4){
+        if(iter == maxiter){
+            escaped = 0;
+            break;
+        }
+        double tr = zr * zr - zi * zi + cr;
+        double ti = 2 * zr * zi + ci;
+        zr = tr;
+        zi = ti;
+        iter++;
+    }
+    o->zr = zr;
+    o->zi = zi;
+    o->iter = iter;
+    return escaped;
+}
+
+/* Conjugate symmetry: c and its conjugate escape after the same number of
+ * iterations. Row j of an image has ci = ylower + step*j, so when
+ * m = -2*ylower/step is a whole number, row j is the mirror image of row
+ * m - j. Sets [*lo, *hi) to the rows that can be copied from rows m - j,
+ * none of which are in [*lo, *hi) themselves, and returns m. Returns -1
+ * when the rows do not line up with the real axis or none are mirrored.
+ */
+static int mandel_mirror_rows(double ylower, double step, int height, int *lo, int *hi){
+    double m = -2 * ylower / step;
+    *lo = *hi = 0;
+    if(!(m >= 1 && m < 2.0 * height - 2) || fabs(m - nearbyint(m)) > 1e-9){
+        return -1;
+    }
+    int sum = (int) nearbyint(m);
+    int first = sum - (height - 1) > 0 ? sum - (height - 1) : 0;
+    int last = (sum + 1) / 2 < height ? (sum + 1) / 2 : height;
+    if(last <= first){
+        return -1;
+    }
+    *lo = first;
+    *hi = last;
+    return sum;
+}
+
+/* Kernel by name: scalar, avx2, avx512 or auto (the widest this CPU runs).
+ * Returns NULL for an unknown name or one the CPU cannot run.
+ */
+static mandel_span_fn mandel_select(const char *name, const char **chosen){
+    int avx2 = __builtin_cpu_supports("avx2");
+    int avx512 = __builtin_cpu_supports("avx512f");
+
+    if(strcmp(name, "auto") == 0){
+        name = avx512 ? "avx512" : avx2 ? "avx2" : "scalar";
+    }
+    *chosen = name;
+    if(strcmp(name, "scalar") == 0){
+        return mandel_span_scalar;
+    }
+    if(strcmp(name, "avx2") == 0 && avx2){
+        return mandel_span_avx2;
+    }
+    if(strcmp(name, "avx512") == 0 && avx512){
+        return mandel_span_avx512;
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * Perturbation theory renderer for zooms deeper than double precision.
+ *
+ * One reference orbit Z_n of the point C is iterated in double-double
+ * (dd.h) and stored rounded to double. A pixel c = C + dc is iterated as
+ * its difference d_n = z_n - Z_n from the reference,
+ *
+ *     d_{n+1} = 2 Z_n d_n + d_n^2 + dc,
+ *
+ * which stays small enough for plain doubles. The orbit here starts at
+ * Z_0 = 0, so the repo's z = c is Z_1, and the pixel's iteration count is
+ * one less than its orbit index.
+ *
+ * Glitches, where d_n loses the precision of z_n, are avoided by
+ * rebasing: once |z_n| < |d_n|, or the reference has escaped, the pixel
+ * continues with d = z_n against the start of the orbit.
+ *
+ * Series approximation: d_n = A_n dc + B_n dc^2 + C_n dc^3 lets every
+ * pixel start at orbit index skip instead of 1. skip is the furthest
+ * index at which the series stays accurate for the image's corners,
+ * checked against corners iterated in full.
+ *
+ * Depth is limited by the reference point, which has about 32 digits,
+ * so widths down to about 1e-30.
+ */
+#ifndef MANDEL_PERTURB_H
+#define MANDEL_PERTURB_H
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "dd.h"
+#include "mandel_kernel.h"
+
+typedef struct {
+    int len;            /* Z_0 .. Z_{len-1}, the last has escaped unless len = maxiter+2 */
+    double *zr, *zi;
+    int skip;           /* orbit index pixels start at, 1 without series */
+    double ar, ai, br, bi, cr, ci;  /* series coefficients at skip */
+} mandel_reference_t;
+
+/* Reference orbit of (cr, ci) */
+static void mandel_reference(mandel_reference_t *ref, dd_t cr, dd_t ci, int maxiter){
+    ref->zr = malloc((maxiter + 2) * sizeof(double));
+    ref->zi = malloc((maxiter + 2) * sizeof(double));
+    ref->zr[0] = ref->zi[0] = 0;
+    ref->len = maxiter + 2;
+    ref->skip = 1;
+
+    dd_t zr = dd_from(0.0), zi = dd_from(0.0);
+    for(int n = 1; n < maxiter + 2; n++){
+        dd_t zri = dd_mul(zr, zi);
+        zr = dd_add(dd_sub(dd_mul(zr, zr), dd_mul(zi, zi)), cr);
+        zi = dd_add(dd_mul_d(zri, 2.0), ci);
+        ref->zr[n] = zr.hi;
+        ref->zi[n] = zi.hi;
+        if(zr.hi * zr.hi + zi.hi * zi.hi >= 4){
+            ref->len = n + 1;
+            break;
+        }
+    }
+}
+
+static void mandel_reference_free(mandel_reference_t *ref){
+    free(ref->zr);
+    free(ref->zi);
+}
+
+/* Iterates d from orbit index n with count iter, for at most limit
+ * indices when limit > 0. Returns the count, or -1 if limit is set and
+ * the pixel escaped or needed a rebase before reaching it.
+ */
+static int mandel_perturb_orbit(const mandel_reference_t *ref, int maxiter, mandel_stats_t *s,
+                                double dcr, double dci, int n, int iter,
+                                double *dr, double *di, int limit){
+    double xr = *dr, xi = *di;
+    for(;;){
+        double zr = ref->zr[n] + xr, zi = ref->zi[n] + xi;
+        if(!(zr * zr + zi * zi < 4)){
+            if(limit > 0){
+                return -1;
+            }
+            break;
+        }
+        double tr = 2 * ref->zr[n] + xr, ti = 2 * ref->zi[n] + xi;
+        double nr = tr * xr - ti * xi + dcr;
+        xi = tr * xi + ti * xr + dci;
+        xr = nr;
+        n++;
+        iter++;
+        if(iter == maxiter || n == limit){
+            break;
+        }
+        zr = ref->zr[n] + xr;
+        zi = ref->zi[n] + xi;
+        if(n == ref->len - 1 || zr * zr + zi * zi < xr * xr + xi * xi){
+            if(limit > 0){
+                return -1;
+            }
+            xr = zr;
+            xi = zi;
+            n = 0;
+            s->rebased++;
+        }
+    }
+    *dr = xr;
+    *di = xi;
+    return iter;
+}
+
+/* Series approximated d at the reference's skip index */
+static inline void mandel_series_delta(const mandel_reference_t *ref, double dcr, double dci,
+                                       double *dr, double *di){
+    double d2r = dcr * dcr - dci * dci, d2i = 2 * dcr * dci;
+    double d3r = d2r * dcr - d2i * dci, d3i = d2r * dci + d2i * dcr;
+    *dr = ref->ar * dcr - ref->ai * dci + ref->br * d2r - ref->bi * d2i + ref->cr * d3r - ref->ci * d3i;
+    *di = ref->ar * dci + ref->ai * dcr + ref->br * d2i + ref->bi * d2r + ref->cr * d3i + ref->ci * d3r;
+}
+
+/* Picks the series skip index for pixels with |dc.real| <= hr and
+ * |dc.imag| <= hi. The series is followed while the cubic term stays
+ * below tol of the linear one, then shortened until the four corners
+ * agree with full iteration to within tol.
+ */
+static void mandel_series(mandel_reference_t *ref, int maxiter, double hr, double hi, double tol){
+    int len = ref->len - 1;
+    double *coef = malloc(6 * (size_t) (len + 1) * sizeof(double));
+    double d = sqrt(hr * hr + hi * hi);
+
+    /* d_1 = dc: A_1 = 1, B_1 = C_1 = 0 */
+    double ar = 1, ai = 0, br = 0, bi = 0, cr = 0, ci = 0;
+    int candidate = 1;
+    for(int n = 1; n < len && n < maxiter; n++){
+        double *k = &coef[6 * n];
+        k[0] = ar; k[1] = ai; k[2] = br; k[3] = bi; k[4] = cr; k[5] = ci;
+        if(hypot(cr, ci) * d * d > tol * hypot(ar, ai)){
+            break;
+        }
+        candidate = n;
+
+        double zr = 2 * ref->zr[n], zi = 2 * ref->zi[n];
+        double ncr = zr * cr - zi * ci + 2 * (ar * br - ai * bi);
+        double nci = zr * ci + zi * cr + 2 * (ar * bi + ai * br);
+        double nbr = zr * br - zi * bi + ar * ar - ai * ai;
+        double nbi = zr * bi + zi * br + 2 * ar * ai;
+        double nar = zr * ar - zi * ai + 1;
+        double nai = zr * ai + zi * ar;
+        ar = nar; ai = nai; br = nbr; bi = nbi; cr = ncr; ci = nci;
+    }
+
+    const double corner[4][2] = { { -hr, -hi }, { hr, -hi }, { -hr, hi }, { hr, hi } };
+    mandel_stats_t scratch = { 0 };
+    for(; candidate > 1; candidate = candidate * 3 / 4){
+        const double *k = &coef[6 * candidate];
+        ref->ar = k[0]; ref->ai = k[1]; ref->br = k[2]; ref->bi = k[3]; ref->cr = k[4]; ref->ci = k[5];
+        int good = 1;
+        for(int c = 0; c < 4 && good; c++){
+            double er = corner[c][0], ei = corner[c][1];
+            if(mandel_perturb_orbit(ref, maxiter, &scratch, corner[c][0], corner[c][1],
+                                    1, 0, &er, &ei, candidate) < 0){
+                good = 0;
+                break;
+            }
+            double sr, si;
+            mandel_series_delta(ref, corner[c][0], corner[c][1], &sr, &si);
+            good = hypot(sr - er, si - ei) <= tol * hypot(er, ei);
+        }
+        if(good){
+            break;
+        }
+    }
+    if(candidate > 1){
+        ref->skip = candidate;
+    }
+    free(coef);
+}
+
+/* Iteration counts of pixels dc = (x0 + step*(i0+k), dci), k < n */
+static void mandel_perturb_span(const mandel_reference_t *ref, const mandel_params_t *p,
+                                mandel_stats_t *s, double x0, double step, double dci,
+                                int i0, int n, int *out){
+    for(int k = 0; k < n; k++){
+        double dcr = x0 + step * (i0 + k);
+        double dr = dcr, di = dci;
+        if(ref->skip > 1){
+            mandel_series_delta(ref, dcr, dci, &dr, &di);
+            s->skipped += ref->skip - 1;
+        }
+        out[k] = mandel_perturb_orbit(ref, p->maxiter, s, dcr, dci, ref->skip, ref->skip - 1,
+                                      &dr, &di, 0);
+    }
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Mariani-Silver rectangle subdivision on top of the span kernels in
+ * mandel_kernel.h.
+ *
+ * The border of a rectangle is computed first. If every border pixel has
+ * the same count the inside is filled with it, otherwise the rectangle is
+ * cut in two across its longer side and both halves go on the work stack.
+ * Rectangles with a side of min_size or less are computed in full. Pixels
+ * are marked -1 until computed, so borders shared with the parent or a
+ * sibling are not computed twice.
+ *
+ * Filling assumes the set is connected inside a uniform border, so thin
+ * filaments narrower than a pixel can be lost. That is why it is an
+ * option and not the default.
+ */
+#ifndef MANDEL_RECT_H
+#define MANDEL_RECT_H
+
+#include <stdlib.h>
+
+#include "mandel_kernel.h"
+
+typedef struct {
+    int x0, y0, x1, y1;
+} mandel_rect_t;
+
+/* Computes the pixels still marked -1 in row y, columns [x0, x1) */
+static void mandel_rect_row(mandel_span_fn kernel, const mandel_params_t *p, mandel_stats_t *s,
+                            double xleft, double ylower, double step,
+                            int *row, int y, int x0, int x1){
+    int x = x0;
+    while(x < x1){
+        if(row[x] != -1){
+            x++;
+            continue;
+        }
+        int end = x;
+        while(end < x1 && row[end] == -1){
+            end++;
+        }
+        /* Border columns come one pixel at a time, too short for a vector */
+        mandel_span_fn f = end - x < 8 ? mandel_span_scalar : kernel;
+        f(p, s, xleft, step, ylower + step * y, x, end - x, &row[x]);
+        x = end;
+    }
+}
+
+/* Computes rows [y0, y1) of a width pixel wide image into img, which
+ * holds just those rows. Adds the number of filled pixels to s->filled.
+ */
+static void mandel_subdivide(mandel_span_fn kernel, const mandel_params_t *p, mandel_stats_t *s,
+                             double xleft, double ylower, double step,
+                             int width, int y0, int y1, int *img, int min_size){
+    for(long i = 0; i < (long) width * (y1 - y0); i++){
+        img[i] = -1;
+    }
+
+    int capacity = 64, top = 0;
+    mandel_rect_t *stack = malloc(capacity * sizeof(mandel_rect_t));
+    stack[top++] = (mandel_rect_t){ 0, y0, width, y1 };
+
+    #define RECT_ROW(y) (&img[(long) ((y) - y0) * width])
+    while(top > 0){
+        mandel_rect_t r = stack[--top];
+        int w = r.x1 - r.x0, h = r.y1 - r.y0;
+
+        if(w <= min_size || h <= min_size){
+            for(int y = r.y0; y < r.y1; y++){
+                mandel_rect_row(kernel, p, s, xleft, ylower, step, RECT_ROW(y), y, r.x0, r.x1);
+            }
+            continue;
+        }
+
+        /* Border: top and bottom rows, then the two columns between */
+        mandel_rect_row(kernel, p, s, xleft, ylower, step, RECT_ROW(r.y0), r.y0, r.x0, r.x1);
+        mandel_rect_row(kernel, p, s, xleft, ylower, step, RECT_ROW(r.y1-1), r.y1-1, r.x0, r.x1);
+        for(int y = r.y0 + 1; y < r.y1 - 1; y++){
+            mandel_rect_row(kernel, p, s, xleft, ylower, step, RECT_ROW(y), y, r.x0, r.x0+1);
+            mandel_rect_row(kernel, p, s, xleft, ylower, step, RECT_ROW(y), y, r.x1-1, r.x1);
+        }
+
+        int value = RECT_ROW(r.y0)[r.x0];
+        int uniform = 1;
+        for(int x = r.x0; x < r.x1 && uniform; x++){
+            uniform = RECT_ROW(r.y0)[x] == value && RECT_ROW(r.y1-1)[x] == value;
+        }
+        for(int y = r.y0 + 1; y < r.y1 - 1 && uniform; y++){
+            uniform = RECT_ROW(y)[r.x0] == value && RECT_ROW(y)[r.x1-1] == value;
+        }
+
+        if(uniform){
+            for(int y = r.y0 + 1; y < r.y1 - 1; y++){
+                for(int x = r.x0 + 1; x < r.x1 - 1; x++){
+                    RECT_ROW(y)[x] = value;
+                }
+            }
+            long inside = (long) (w - 2) * (h - 2);
+            s->filled += inside;
+            s->skipped += (double) value * inside;
+            continue;
+        }
+
+        if(top + 2 > capacity){
+            capacity *= 2;
+            stack = realloc(stack, capacity * sizeof(mandel_rect_t));
+        }
+        if(w >= h){
+            int xm = r.x0 + w / 2;
+            stack[top++] = (mandel_rect_t){ r.x0, r.y0, xm, r.y1 };
+            stack[top++] = (mandel_rect_t){ xm, r.y0, r.x1, r.y1 };
+        }
+        else{
+            int ym = r.y0 + h / 2;
+            stack[top++] = (mandel_rect_t){ r.x0, r.y0, r.x1, ym };
+            stack[top++] = (mandel_rect_t){ r.x0, ym, r.x1, r.y1 };
+        }
+    }
+    #undef RECT_ROW
+    free(stack);
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Shared memory renderer with work stealing, on top of the span kernels
+ * in mandel_kernel.h.
+ *
+ * The rows are cut into tiles of MANDEL_TILE_W x MANDEL_TILE_H pixels.
+ * Every thread starts with an equal run of consecutive tiles in its own
+ * Chase-Lev deque. The owner takes tiles from the bottom, and a thread
+ * whose deque is empty steals from the top of another one, starting at a
+ * random victim. The deque follows Le, Pop, Cohen and Zappa Nardelli,
+ * "Correct and efficient work-stealing for weak memory models" (2013),
+ * with __atomic builtins for the C11 orderings.
+ *
+ * No tiles are added once the threads run, so a thread that finds every
+ * deque empty is done. The deques therefore never grow.
+ */
+#ifndef MANDEL_STEAL_H
+#define MANDEL_STEAL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "mandel_kernel.h"
+
+#define MANDEL_TILE_W 128
+#define MANDEL_TILE_H 4
+
+/* What take and steal return instead of a tile */
+#define MANDEL_DEQUE_EMPTY -1
+#define MANDEL_DEQUE_ABORT -2
+
+typedef struct {
+    long top, bottom;
+    int *buf;
+    long mask;
+} mandel_deque_t;
+
+/* A deque for up to capacity tiles at a time */
+static void mandel_deque_init(mandel_deque_t *q, long capacity){
+    long size = 1;
+    while(size < capacity){
+        size *= 2;
+    }
+    q->top = q->bottom = 0;
+    q->buf = malloc(size * sizeof(int));
+    q->mask = size - 1;
+}
+
+/* Owner only */
+static void mandel_deque_push(mandel_deque_t *q, int x){
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->buf[b & q->mask], x, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/* Owner only, the most recently pushed tile or MANDEL_DEQUE_EMPTY */
+static int mandel_deque_take(mandel_deque_t *q){
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+    if(t > b){
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return MANDEL_DEQUE_EMPTY;
+    }
+    int x = __atomic_load_n(&q->buf[b & q->mask], __ATOMIC_RELAXED);
+    if(t == b){
+        /* The last tile, which a thief may be taking at the same time */
+        if(!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+            x = MANDEL_DEQUE_EMPTY;
+        }
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return x;
+}
+
+/* Any thread, the oldest tile, MANDEL_DEQUE_EMPTY, or MANDEL_DEQUE_ABORT
+ * when another thread got there first */
+static int mandel_deque_steal(mandel_deque_t *q){
+    long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+    if(t >= b){
+        return MANDEL_DEQUE_EMPTY;
+    }
+    int x = __atomic_load_n(&q->buf[t & q->mask], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+        return MANDEL_DEQUE_ABORT;
+    }
+    return x;
+}
+
+typedef struct {
+    mandel_span_fn kernel;
+    const mandel_params_t *p;
+    double xleft, step;
+    const double *ci;
+    int rows, width, tiles_x;
+    int *out;
+    int nthreads;
+    mandel_deque_t *deques;
+} mandel_steal_job_t;
+
+typedef struct {
+    const mandel_steal_job_t *job;
+    int id;
+    mandel_stats_t stats;
+    long stolen;
+} mandel_steal_worker_t;
+
+static void mandel_steal_tile(const mandel_steal_job_t *job, mandel_stats_t *s, int tile){
+    int x0 = tile % job->tiles_x * MANDEL_TILE_W, y0 = tile / job->tiles_x * MANDEL_TILE_H;
+    int w = job->width - x0 < MANDEL_TILE_W ? job->width - x0 : MANDEL_TILE_W;
+    int y1 = job->rows - y0 < MANDEL_TILE_H ? job->rows : y0 + MANDEL_TILE_H;
+    for(int y = y0; y < y1; y++){
+        job->kernel(job->p, s, job->xleft, job->step, job->ci[y], x0, w,
+                    &job->out[(long) y * job->width + x0]);
+    }
+}
+
+static void *mandel_steal_thread(void *arg){
+    mandel_steal_worker_t *w = arg;
+    const mandel_steal_job_t *job = w->job;
+    unsigned seed = 2654435761u * (w->id + 1);
+
+    for(;;){
+        int tile = mandel_deque_take(&job->deques[w->id]);
+        if(tile >= 0){
+            mandel_steal_tile(job, &w->stats, tile);
+            continue;
+        }
+        /* Sweep the other deques from a random one. An abort means there
+         * may still be tiles, only empty everywhere means done */
+        int busy;
+        do{
+            busy = 0;
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            for(int k = 0; k < job->nthreads && tile < 0; k++){
+                int victim = (seed + k) % job->nthreads;
+                if(victim == w->id){
+                    continue;
+                }
+                tile = mandel_deque_steal(&job->deques[victim]);
+                busy |= tile == MANDEL_DEQUE_ABORT;
+            }
+        }while(tile < 0 && busy);
+        if(tile < 0){
+            return NULL;
+        }
+        w->stolen++;
+        mandel_steal_tile(job, &w->stats, tile);
+    }
+}
+
+/* Computes rows pixels wide rows into out with nthreads threads, row r
+ * with imaginary part ci[r] and pixel i with real part xleft + step*i.
+ * Adds the threads' counters to s and returns the number of tiles stolen.
+ */
+static long mandel_steal_render(mandel_span_fn kernel, const mandel_params_t *p, mandel_stats_t *s,
+                                int nthreads, double xleft, double step, const double *ci,
+                                int rows, int width, int *out){
+    int tiles_x = (width + MANDEL_TILE_W - 1) / MANDEL_TILE_W;
+    int tiles = tiles_x * ((rows + MANDEL_TILE_H - 1) / MANDEL_TILE_H);
+    mandel_steal_job_t job = { kernel, p, xleft, step, ci, rows, width, tiles_x, out, nthreads, NULL };
+    job.deques = malloc(nthreads * sizeof(mandel_deque_t));
+    mandel_steal_worker_t *workers = calloc(nthreads, sizeof(mandel_steal_worker_t));
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+
+    /* Pushed last to first, so the owner works through its run in order
+     * and thieves take from the far end */
+    for(int k = 0; k < nthreads; k++){
+        int first = (long) tiles * k / nthreads, last = (long) tiles * (k + 1) / nthreads;
+        mandel_deque_init(&job.deques[k], last - first);
+        for(int t = last - 1; t >= first; t--){
+            mandel_deque_push(&job.deques[k], t);
+        }
+        workers[k].job = &job;
+        workers[k].id = k;
+    }
+
+    /* The calling thread is worker 0 */
+    for(int k = 1; k < nthreads; k++){
+        pthread_create(&threads[k], NULL, mandel_steal_thread, &workers[k]);
+    }
+    mandel_steal_thread(&workers[0]);
+
+    /* Every thread may still steal from any deque until all have finished */
+    for(int k = 1; k < nthreads; k++){
+        pthread_join(threads[k], NULL);
+    }
+    long stolen = 0;
+    for(int k = 0; k < nthreads; k++){
+        s->culled += workers[k].stats.culled;
+        s->periodic += workers[k].stats.periodic;
+        s->skipped += workers[k].stats.skipped;
+        stolen += workers[k].stolen;
+        free(job.deques[k].buf);
+    }
+    free(job.deques);
+    free(workers);
+    free(threads);
+    return stolen;
+}
+
+#endif
@@ -0,0 +1,226 @@
+/*
+ * Optional hardware counter collection around kernel regions.
+ *
+ * Compile with -DPERF_COUNTERS to enable (make PERF=1), otherwise every
+ * call below compiles to nothing. Counters are read with Linux
+ * perf_event_open: cycles, instructions, L1D read misses and LLC read
+ * misses. LLC misses * 64 bytes is used as a DRAM bandwidth proxy, and the
+ * caller supplies a model of bytes moved and flops per invocation, since
+ * there is no portable FP-op event.
+ *
+ * Usage, single threaded kernel:
+ *
+ *   static perf_region_t ftcs_perf = PERF_REGION_INIT("ftcs_solver");
+ *   perf_region_start(&ftcs_perf);
+ *   ftcs_solver(step);
+ *   perf_region_stop(&ftcs_perf, bytes, flops);
+ *   ...
+ *   perf_region_report(&ftcs_perf, "");
+ *
+ * perf_region_start/stop count the calling thread. Threaded kernels call
+ * perf_thread_start/stop inside every worker as well, the counts are
+ * summed into the region. A thread's counters stay open between calls and
+ * are closed when the thread exits, so pools and threads created per step
+ * both work.
+ *
+ * Set PERF_EACH=1 in the environment to print a line per invocation.
+ */
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <stdio.h>
+
+#ifdef PERF_COUNTERS
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum { PERF_CYCLES, PERF_INSTR, PERF_L1_MISS, PERF_LLC_MISS, PERF_NEVENTS };
+
+typedef struct {
+    const char *name;
+    /* Summed over all threads, updated atomically */
+    uint64_t count[PERF_NEVENTS];
+    /* Snapshot of count[] when the current invocation started */
+    uint64_t mark[PERF_NEVENTS];
+    double t_start;
+    long calls;
+    double seconds, bytes, flops;
+    uint64_t total[PERF_NEVENTS];
+} perf_region_t;
+
+typedef struct {
+    uint64_t value[PERF_NEVENTS];
+} perf_sample_t;
+
+#define PERF_REGION_INIT(n) { .name = (n) }
+
+/* One set of counters per thread, opened on first use */
+static __thread int perf_fd[PERF_NEVENTS];
+static __thread int perf_opened = 0;
+/* Set when at least one event could be opened on any thread */
+static int perf_available = 0;
+/* Its destructor closes a thread's counters when the thread exits */
+static pthread_key_t perf_exit_key;
+static pthread_once_t perf_exit_once = PTHREAD_ONCE_INIT;
+
+static double perf_now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static int perf_open_event(uint32_t type, uint64_t config){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_close_thread(void *unused){
+    (void)unused;
+    for(int e = 0; e < PERF_NEVENTS; e++){
+        if(perf_fd[e] >= 0){
+            close(perf_fd[e]);
+        }
+        perf_fd[e] = -1;
+    }
+    perf_opened = 0;
+}
+
+static void perf_make_exit_key(){
+    pthread_key_create(&perf_exit_key, perf_close_thread);
+}
+
+static void perf_open_thread(){
+    const uint64_t l1 = PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const uint64_t llc = PERF_COUNT_HW_CACHE_LL |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+    perf_fd[PERF_CYCLES] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    perf_fd[PERF_INSTR] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    perf_fd[PERF_L1_MISS] = perf_open_event(PERF_TYPE_HW_CACHE, l1);
+    perf_fd[PERF_LLC_MISS] = perf_open_event(PERF_TYPE_HW_CACHE, llc);
+
+    for(int e = 0; e < PERF_NEVENTS; e++){
+        if(perf_fd[e] >= 0){
+            __atomic_store_n(&perf_available, 1, __ATOMIC_RELAXED);
+        }
+    }
+    perf_opened = 1;
+
+    /* Any non-NULL value makes the destructor run at thread exit */
+    pthread_once(&perf_exit_once, perf_make_exit_key);
+    pthread_setspecific(perf_exit_key, perf_fd);
+}
+
+static void perf_thread_start(perf_sample_t *s){
+    if(!perf_opened){
+        perf_open_thread();
+    }
+    for(int e = 0; e < PERF_NEVENTS; e++){
+        s->value[e] = 0;
+        if(perf_fd[e] >= 0 && read(perf_fd[e], &s->value[e], sizeof(uint64_t)) != sizeof(uint64_t)){
+            s->value[e] = 0;
+        }
+    }
+}
+
+static void perf_thread_stop(perf_sample_t *s, perf_region_t *r){
+    for(int e = 0; e < PERF_NEVENTS; e++){
+        uint64_t v = 0;
+        if(perf_fd[e] >= 0 && read(perf_fd[e], &v, sizeof(uint64_t)) == sizeof(uint64_t)){
+            __atomic_fetch_add(&r->count[e], v - s->value[e], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Calling thread's sample for the serial case */
+static __thread perf_sample_t perf_main_sample;
+
+static void perf_region_start(perf_region_t *r){
+    for(int e = 0; e < PERF_NEVENTS; e++){
+        r->mark[e] = __atomic_load_n(&r->count[e], __ATOMIC_RELAXED);
+    }
+    perf_thread_start(&perf_main_sample);
+    r->t_start = perf_now();
+}
+
+static void perf_print_line(FILE *f, const char *prefix, const char *name, long calls,
+        double seconds, double bytes, double flops, const uint64_t *c){
+    fprintf(f, "%s%-12s calls %6ld  %9.6f s  %7.2f GB/s  %7.2f GFLOP/s",
+            prefix, name, calls, seconds, bytes/seconds*1e-9, flops/seconds*1e-9);
+    if(perf_available){
+        fprintf(f, "  IPC %5.2f  L1 miss %.3g  LLC miss %.3g  LLC %7.2f GB/s",
+                c[PERF_CYCLES] ? (double)c[PERF_INSTR]/c[PERF_CYCLES] : 0.0,
+                (double)c[PERF_L1_MISS], (double)c[PERF_LLC_MISS],
+                c[PERF_LLC_MISS]*64.0/seconds*1e-9);
+    }
+    else{
+        fprintf(f, "  (no hardware counters)");
+    }
+    fprintf(f, "\n");
+}
+
+/* bytes and flops are the caller's model of this invocation */
+static void perf_region_stop(perf_region_t *r, double bytes, double flops){
+    double seconds = perf_now() - r->t_start;
+    perf_thread_stop(&perf_main_sample, r);
+
+    uint64_t delta[PERF_NEVENTS];
+    for(int e = 0; e < PERF_NEVENTS; e++){
+        delta[e] = __atomic_load_n(&r->count[e], __ATOMIC_RELAXED) - r->mark[e];
+        r->total[e] += delta[e];
+    }
+    r->calls++;
+    r->seconds += seconds;
+    r->bytes += bytes;
+    r->flops += flops;
+
+    static int each = -1;
+    if(each < 0){
+        each = getenv("PERF_EACH") != NULL && atoi(getenv("PERF_EACH")) != 0;
+    }
+    if(each){
+        perf_print_line(stderr, "perf: ", r->name, r->calls, seconds, bytes, flops, delta);
+    }
+}
+
+static void perf_region_report(perf_region_t *r, const char *prefix){
+    if(r->calls == 0){
+        return;
+    }
+    char p[64];
+    snprintf(p, sizeof(p), "perf: %s", prefix);
+    perf_print_line(stderr, p, r->name, r->calls, r->seconds, r->bytes, r->flops, r->total);
+}
+
+#else
+
+typedef struct { int unused; } perf_region_t;
+typedef struct { int unused; } perf_sample_t;
+
+#define PERF_REGION_INIT(n) { 0 }
+#define perf_thread_start(s) ((void)(s))
+#define perf_thread_stop(s, r) ((void)(s), (void)(r))
+#define perf_region_start(r) ((void)(r))
+#define perf_region_stop(r, bytes, flops) ((void)(r))
+#define perf_region_report(r, prefix) ((void)(r))
+
+#endif
+
+#endif
@@ -0,0 +1,30 @@
+#include <omp.h>
+
+#include "heat.h"
+
+/* Rows split evenly over the OpenMP team */
+void omp_step( heat_grid_t *g, int step ){
+    #pragma omp parallel num_threads(g->n_threads)
+    {
+        int t = omp_get_thread_num();
+        int y0, y1;
+        thread_rows(g->ny, t, omp_get_num_threads(), &y0, &y1);
+
+        /* The master thread is already counted by the driver */
+        perf_sample_t perf_sample;
+        if(t != 0){
+            perf_thread_start(&perf_sample);
+        }
+
+        ftcs_block(g, step, 0, g->nx, y0, y1);
+
+        if(t != 0){
+            perf_thread_stop(&perf_sample, g->perf);
+        }
+    }
+}
+
+const heat_backend_t omp_backend = {
+    .name = "omp",
+    .step = omp_step,
+};
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "heat.h"
+
+/*
+ * Persistent thread pool. Workers are created once and meet the calling
+ * thread at a barrier before and after every step, instead of being
+ * created and joined every step as in PS3/pthreads.
+ */
+
+static pthread_t *thread_handles;
+static pthread_barrier_t start_barrier, done_barrier;
+static heat_grid_t *pool_grid;
+static int pool_step;
+static int pool_quit;
+
+static void pool_work( int t ){
+    int y0, y1;
+    thread_rows(pool_grid->ny, t, pool_grid->n_threads, &y0, &y1);
+    ftcs_block(pool_grid, pool_step, 0, pool_grid->nx, y0, y1);
+}
+
+static void* pool_thread( void *arguments ){
+    int t = (int)(long)arguments;
+    for(;;){
+        pthread_barrier_wait(&start_barrier);
+        if(pool_quit){
+            break;
+        }
+        perf_sample_t perf_sample;
+        perf_thread_start(&perf_sample);
+        pool_work(t);
+        perf_thread_stop(&perf_sample, pool_grid->perf);
+        pthread_barrier_wait(&done_barrier);
+    }
+    return NULL;
+}
+
+void pthread_init( heat_grid_t *g ){
+    pool_grid = g;
+    pool_quit = 0;
+    pthread_barrier_init(&start_barrier, NULL, g->n_threads);
+    pthread_barrier_init(&done_barrier, NULL, g->n_threads);
+
+    /* The calling thread works as thread 0 */
+    thread_handles = malloc(g->n_threads * sizeof(pthread_t));
+    for(long t = 1; t < g->n_threads; t++){
+        pthread_create(&thread_handles[t], NULL, pool_thread, (void*)t);
+    }
+}
+
+void pthread_step( heat_grid_t *g, int step ){
+    pool_step = step;
+    pthread_barrier_wait(&start_barrier);
+    pool_work(0);
+    pthread_barrier_wait(&done_barrier);
+}
+
+void pthread_finalize( heat_grid_t *g ){
+    pool_quit = 1;
+    pthread_barrier_wait(&start_barrier);
+    for(int t = 1; t < g->n_threads; t++){
+        pthread_join(thread_handles[t], NULL);
+    }
+    free(thread_handles);
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&done_barrier);
+}
+
+const heat_backend_t pthread_backend = {
+    .name = "pthread",
+    .init = pthread_init,
+    .step = pthread_step,
+    .finalize = pthread_finalize,
+};
@@ -0,0 +1,11 @@
+#include "heat.h"
+
+/* Reference backend, one thread, row order */
+void serial_step( heat_grid_t *g, int step ){
+    ftcs_block(g, step, 0, g->nx, 0, g->ny);
+}
+
+const heat_backend_t serial_backend = {
+    .name = "serial",
+    .step = serial_step,
+};
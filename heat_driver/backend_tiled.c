@@ -0,0 +1,42 @@
+#include <omp.h>
+
+#include "heat.h"
+
+/*
+ * Cache blocked stencil: the grid is cut into tile[0] x tile[1] blocks
+ * which are handed out to the OpenMP team, so the three rows a block
+ * touches stay in cache for wide grids.
+ */
+void tiled_step( heat_grid_t *g, int step ){
+    int tx = g->tile[0], ty = g->tile[1];
+    int nbx = (g->nx + tx - 1) / tx;
+    int nby = (g->ny + ty - 1) / ty;
+
+    #pragma omp parallel num_threads(g->n_threads)
+    {
+        perf_sample_t perf_sample;
+        int t = omp_get_thread_num();
+        if(t != 0){
+            perf_thread_start(&perf_sample);
+        }
+
+        #pragma omp for collapse(2) schedule(static)
+        for(int by = 0; by < nby; by++){
+            for(int bx = 0; bx < nbx; bx++){
+                int x0 = bx*tx, y0 = by*ty;
+                int x1 = x0 + tx < g->nx ? x0 + tx : g->nx;
+                int y1 = y0 + ty < g->ny ? y0 + ty : g->ny;
+                ftcs_block(g, step, x0, x1, y0, y1);
+            }
+        }
+
+        if(t != 0){
+            perf_thread_stop(&perf_sample, g->perf);
+        }
+    }
+}
+
+const heat_backend_t tiled_backend = {
+    .name = "tiled",
+    .step = tiled_step,
+};
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <mpi.h>
+
+#include "heat.h"
+#include "bmp.h"
+
+/*
+ * Heat equation driver with run time selectable backends.
+ *
+ * The grid is split into slabs of rows over the MPI ranks. Each rank runs
+ * the chosen backend on its slab, with halo rows exchanged between steps.
+ * Initial state, external heat, output and timing are shared, so several
+ * backends can be run back to back on identical inputs in one job and
+ * compared against the first one.
+ *
+ * Useage: mpirun -np <ranks> heat [-b serial,pthread,omp,tiled,simd]
+ *             [-t threads] [-n grid size] [-s steps] [-T tile x,y] [-w]
+ */
+
+/*
+ * Physical quantities, see PS3/openMP/heat_omp.c:
+ * alpha = k / (rho*cp) : thermal diffusivity       [meter^2 / second]
+ */
+const float MERCURY = 0.0619;
+const float COPPER = 0.116;
+const float TIN = 0.040;
+const float ALUMINIUM = 0.098;
+
+/* Discretization: 5cm square cells, 2.5ms time intervals */
+const float
+    h  = 5e-2,
+    dt = 2.5e-3;
+
+/* Parameters of the simulation, can be changed on the command line */
+int GRID_SIZE[2] = {512, 512};
+int NSTEPS = 10000;
+int CUTOFF = 5000;
+int SNAPSHOT = 500;
+
+/* Write snapshots to data/ */
+int write_snapshots = 0;
+
+const heat_backend_t *all_backends[] = {
+    &serial_backend, &pthread_backend, &omp_backend, &tiled_backend, &simd_backend,
+};
+const int N_BACKENDS = sizeof(all_backends)/sizeof(all_backends[0]);
+
+/* Local state */
+int
+    size, rank,                     // World size, my rank
+    north, south,                   // Neighbors in the slab decomposition
+    local_origin,                   // World row of local row 0
+    *row_counts, *row_displs;       // Rows and first row of every rank
+
+heat_grid_t grid;
+
+/* Full field on rank 0, for output and for comparing backends */
+float *temperature, *reference;
+
+
+/* Splits the rows over the ranks, remainder spread over the first ranks */
+void decompose(){
+    row_counts = malloc(size * sizeof(int));
+    row_displs = malloc(size * sizeof(int));
+    for(int r = 0; r < size; r++){
+        int y0, y1;
+        thread_rows(GRID_SIZE[1], r, size, &y0, &y1);
+        row_counts[r] = y1 - y0;
+        row_displs[r] = y0;
+    }
+    local_origin = row_displs[rank];
+    north = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    south = rank < size - 1 ? rank + 1 : MPI_PROC_NULL;
+
+    grid.nx = GRID_SIZE[0];
+    grid.ny = row_counts[rank];
+    grid.stride = grid.nx + 2*BORDER;
+
+    size_t lsize_borders = (size_t)grid.stride * (grid.ny + 2*BORDER);
+    grid.material = calloc((size_t)grid.nx * grid.ny, sizeof(float));
+    grid.temp[0] = calloc(lsize_borders, sizeof(float));
+    grid.temp[1] = calloc(lsize_borders, sizeof(float));
+}
+
+int heating_element(int x, int y){
+    return x >= GRID_SIZE[0]/4 && x <= 3*GRID_SIZE[0]/4 &&
+        y >= GRID_SIZE[1]/2 - GRID_SIZE[1]/16 && y <= GRID_SIZE[1]/2 + GRID_SIZE[1]/16;
+}
+
+/* Same setup as the assignment solvers, each rank fills its own rows */
+void init_temp_material(){
+    for(int x = -BORDER; x < grid.nx + BORDER; x++){
+        for(int y = -BORDER; y < grid.ny + BORDER; y++){
+            grid.temp[0][lti(&grid,x,y)] = 10.0;
+            grid.temp[1][lti(&grid,x,y)] = 10.0;
+        }
+    }
+
+    for(int y = 0; y < grid.ny; y++){
+        int gy = y + local_origin;
+        for(int x = 0; x < grid.nx; x++){
+            float t = 20.0;
+            float m = MERCURY;
+
+            /* The two blocks of copper and tin */
+            if(x >= 5*GRID_SIZE[0]/8 && x < 7*GRID_SIZE[0]/8 &&
+               gy >= GRID_SIZE[1]/8 && gy < 3*GRID_SIZE[1]/8){
+                m = COPPER;
+                t = 60.0;
+            }
+            if(x >= GRID_SIZE[0]/8 && x < GRID_SIZE[0]/2 - GRID_SIZE[0]/8 &&
+               gy >= 5*GRID_SIZE[1]/8 && gy < 7*GRID_SIZE[1]/8){
+                m = TIN;
+                t = 60.0;
+            }
+            /* The heating element in the middle */
+            if(heating_element(x, gy)){
+                m = ALUMINIUM;
+                t = 100.0;
+            }
+            grid.material[lmi(&grid,x,y)] = m * (dt/(h*h));
+            grid.temp[0][lti(&grid,x,y)] = t;
+        }
+    }
+}
+
+void external_heat( int step ){
+    for(int y = 0; y < grid.ny; y++){
+        for(int x = 0; x < grid.nx; x++){
+            if(heating_element(x, y + local_origin)){
+                grid.temp[step%2][lti(&grid,x,y)] = 100.0;
+            }
+        }
+    }
+}
+
+/* Halo rows of the input buffer from the ranks above and below */
+void border_exchange( int step ){
+    float* in = grid.temp[step%2];
+    MPI_Sendrecv(&in[lti(&grid,0,0)], grid.nx, MPI_FLOAT, north, 0,
+                 &in[lti(&grid,0,grid.ny)], grid.nx, MPI_FLOAT, south, 0,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(&in[lti(&grid,0,grid.ny-1)], grid.nx, MPI_FLOAT, south, 1,
+                 &in[lti(&grid,0,-1)], grid.nx, MPI_FLOAT, north, 1,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+}
+
+/* Collects the interior of buffer step%2 into temperature on rank 0 */
+void gather_temp( int step ){
+    float *packed = malloc((size_t)grid.nx * grid.ny * sizeof(float));
+    for(int y = 0; y < grid.ny; y++){
+        memcpy(&packed[y*grid.nx], &grid.temp[step%2][lti(&grid,0,y)], grid.nx * sizeof(float));
+    }
+
+    int *counts = malloc(size * sizeof(int));
+    int *displs = malloc(size * sizeof(int));
+    for(int r = 0; r < size; r++){
+        counts[r] = row_counts[r] * GRID_SIZE[0];
+        displs[r] = row_displs[r] * GRID_SIZE[0];
+    }
+    MPI_Gatherv(packed, grid.nx * grid.ny, MPI_FLOAT,
+                temperature, counts, displs, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    free(counts);
+    free(displs);
+    free(packed);
+}
+
+/* Create nice image from the gathered field. take care to create it upside down (bmp format) */
+void output(char* filename){
+    unsigned char *buffer = calloc((size_t)GRID_SIZE[0] * GRID_SIZE[1] * 3, 1);
+    for (int j = 0; j < GRID_SIZE[1]; j++) {
+        for (int i = 0; i < GRID_SIZE[0]; i++) {
+            int p = ((GRID_SIZE[1] - j - 1) * GRID_SIZE[0] + i) * 3;
+            bmp_heat_colour(buffer + p, temperature[j * GRID_SIZE[0] + i]);
+        }
+    }
+    bmp_save(filename, buffer, GRID_SIZE[0], GRID_SIZE[1]);
+    free(buffer);
+}
+
+void write_temp( const char *backend, int step ){
+    char filename[64];
+    sprintf(filename, "data/%s_%.4d.bmp", backend, step/SNAPSHOT);
+    output(filename);
+}
+
+/* Runs one backend from the initial state, returns seconds spent stepping */
+double run_backend( const heat_backend_t *b, int n_threads ){
+    perf_region_t perf = PERF_REGION_INIT(b->name);
+    grid.n_threads = n_threads;
+    grid.perf = &perf;
+
+    init_temp_material();
+    if(b->init){
+        b->init(&grid);
+    }
+
+    double cells = (double)grid.nx * grid.ny;
+    double stepping = 0;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    // Main integration loop: NSTEPS iterations, impose external heat
+    for( int step=0; step<NSTEPS; step += 1 ){
+        if( step < CUTOFF ){
+            external_heat ( step );
+        }
+        border_exchange( step );
+
+        /* Per cell: read in and material, write out (12 bytes), 7 flops */
+        double t = MPI_Wtime();
+        perf_region_start(&perf);
+        b->step( &grid, step );
+        perf_region_stop(&perf, 12.0*cells, 7.0*cells);
+        stepping += MPI_Wtime() - t;
+
+        if(write_snapshots && (step % SNAPSHOT) == 0){
+            gather_temp( step+1 );
+            if(rank == 0){
+                write_temp( b->name, step );
+            }
+        }
+    }
+
+    if(b->finalize){
+        b->finalize(&grid);
+    }
+
+    char perf_prefix[16];
+    sprintf(perf_prefix, "rank %d ", rank);
+    perf_region_report(&perf, perf_prefix);
+
+    /* The slowest rank decides */
+    double max_stepping;
+    MPI_Reduce(&stepping, &max_stepping, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    return rank == 0 ? max_stepping : stepping;
+}
+
+void usage( char *name ){
+    if(rank == 0){
+        printf("Useage: %s [-b backend,...] [-t threads] [-n grid size] [-s steps] [-T tile x,y] [-w]\n", name);
+        printf("Backends:");
+        for(int i = 0; i < N_BACKENDS; i++){
+            printf(" %s", all_backends[i]->name);
+        }
+        printf(", or all\n");
+    }
+    MPI_Finalize();
+    exit(-1);
+}
+
+int main ( int argc, char **argv ){
+    MPI_Init ( &argc, &argv );
+    MPI_Comm_size ( MPI_COMM_WORLD, &size );
+    MPI_Comm_rank ( MPI_COMM_WORLD, &rank );
+
+    char backend_list[256] = "serial";
+    int n_threads = 1;
+    grid.tile[0] = 256;
+    grid.tile[1] = 16;
+
+    int opt;
+    while((opt = getopt(argc, argv, "b:t:n:s:T:w")) != -1){
+        switch(opt){
+            case 'b':
+                strncpy(backend_list, optarg, sizeof(backend_list)-1);
+                break;
+            case 't':
+                n_threads = atoi(optarg);
+                break;
+            case 'n':
+                GRID_SIZE[0] = GRID_SIZE[1] = atoi(optarg);
+                break;
+            case 's':
+                NSTEPS = atoi(optarg);
+                CUTOFF = NSTEPS/2;
+                SNAPSHOT = NSTEPS/20 > 0 ? NSTEPS/20 : 1;
+                break;
+            case 'T':
+                if(sscanf(optarg, "%d,%d", &grid.tile[0], &grid.tile[1]) != 2){
+                    usage(argv[0]);
+                }
+                break;
+            case 'w':
+                write_snapshots = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(n_threads < 1 || GRID_SIZE[0] < size || grid.tile[0] < 1 || grid.tile[1] < 1){
+        usage(argv[0]);
+    }
+    if(strcmp(backend_list, "all") == 0){
+        backend_list[0] = '\0';
+        for(int i = 0; i < N_BACKENDS; i++){
+            strcat(backend_list, all_backends[i]->name);
+            strcat(backend_list, i < N_BACKENDS-1 ? "," : "");
+        }
+    }
+
+    decompose();
+    if(rank == 0){
+        temperature = malloc((size_t)GRID_SIZE[0] * GRID_SIZE[1] * sizeof(float));
+        reference = malloc((size_t)GRID_SIZE[0] * GRID_SIZE[1] * sizeof(float));
+        printf("Grid %dx%d, %d steps, %d ranks x %d threads\n",
+               GRID_SIZE[0], GRID_SIZE[1], NSTEPS, size, n_threads);
+        printf("%-8s %12s %12s %14s\n", "backend", "step time", "Mcells/s", "max diff");
+    }
+
+    int first = 1;
+    for(char *name = strtok(backend_list, ","); name; name = strtok(NULL, ",")){
+        const heat_backend_t *b = NULL;
+        for(int i = 0; i < N_BACKENDS; i++){
+            if(strcmp(name, all_backends[i]->name) == 0){
+                b = all_backends[i];
+            }
+        }
+        if(!b){
+            if(rank == 0){
+                printf("Unknown backend %s\n", name);
+            }
+            usage(argv[0]);
+        }
+
+        double seconds = run_backend(b, n_threads);
+        gather_temp(NSTEPS);
+
+        if(rank == 0){
+            /* Every backend is compared against the first one */
+            double diff = 0;
+            size_t n = (size_t)GRID_SIZE[0] * GRID_SIZE[1];
+            if(first){
+                memcpy(reference, temperature, n * sizeof(float));
+            }
+            for(size_t i = 0; i < n; i++){
+                diff = fmax(diff, fabs(temperature[i] - reference[i]));
+            }
+            printf("%-8s %10.4f s %12.1f %14g\n", b->name, seconds,
+                   (double)GRID_SIZE[0] * GRID_SIZE[1] * NSTEPS / seconds * 1e-6, diff);
+        }
+        first = 0;
+    }
+
+    if(rank == 0){
+        free(temperature);
+        free(reference);
+    }
+    free(grid.material);
+    free(grid.temp[0]);
+    free(grid.temp[1]);
+    free(row_counts);
+    free(row_displs);
+
+    MPI_Finalize();
+    exit ( EXIT_SUCCESS );
+}
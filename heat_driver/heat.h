@@ -0,0 +1,77 @@
+#ifndef HEAT_H
+#define HEAT_H
+
+#include "perfcount.h"
+
+/* Border thickness */
+#define BORDER 1
+
+/*
+ * Local part of the grid owned by this rank: ny full rows of nx cells.
+ * The temperature buffers carry a one cell halo on all sides, the
+ * material does not.
+ */
+typedef struct {
+    int nx, ny;             // Size of local subdomain
+    int stride;             // Row length of temp, nx + 2*BORDER
+    float *material;        // Local material constants
+    float *temp[2];         // Local temperature (2 buffers)
+    int n_threads;          // Threads the backend may use
+    int tile[2];            // Tile size for blocked backends
+    perf_region_t *perf;    // Counters for the step, workers add to it
+} heat_grid_t;
+
+/*
+ * A backend computes one step of the FTCS stencil:
+ * temp[(step+1)%2] from temp[step%2]. The driver handles everything else
+ * (initial state, external heat, halos, output and timing).
+ */
+typedef struct {
+    const char *name;
+    void (*init)(heat_grid_t *g);       // optional, called before the first step
+    void (*step)(heat_grid_t *g, int step);
+    void (*finalize)(heat_grid_t *g);   // optional
+} heat_backend_t;
+
+extern const heat_backend_t serial_backend;
+extern const heat_backend_t pthread_backend;
+extern const heat_backend_t omp_backend;
+extern const heat_backend_t tiled_backend;
+extern const heat_backend_t simd_backend;
+
+// local temperature
+static inline int lti(const heat_grid_t *g, int x, int y){
+    return (y+BORDER)*g->stride + x + BORDER;
+}
+
+// local material
+static inline int lmi(const heat_grid_t *g, int x, int y){
+    return y*g->nx + x;
+}
+
+/* The stencil on rows [y0, y1), columns [x0, x1), shared by the backends */
+static inline void ftcs_block(heat_grid_t *g, int step, int x0, int x1, int y0, int y1){
+    float* in = g->temp[(step)%2];
+    float* out = g->temp[(step+1)%2];
+
+    for(int y = y0; y < y1; y++){
+        for(int x = x0; x < x1; x++){
+            out[lti(g,x,y)] = in[lti(g,x,y)] + g->material[lmi(g,x,y)]*
+                           (in[lti(g,x+1,y)] +
+                           in[lti(g,x-1,y)] +
+                           in[lti(g,x,y+1)] +
+                           in[lti(g,x,y-1)] -
+                           4*in[lti(g,x,y)]);
+        }
+    }
+}
+
+/* Rows [*y0, *y1) of thread t out of n, remainder spread over the first threads */
+static inline void thread_rows(int ny, int t, int n, int *y0, int *y1){
+    int base = ny / n;
+    int extra = ny % n;
+    *y0 = t*base + (t < extra ? t : extra);
+    *y1 = *y0 + base + (t < extra ? 1 : 0);
+}
+
+#endif
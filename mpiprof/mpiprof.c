@@ -0,0 +1,630 @@
+/*
+ * Communication profiler built on the PMPI interface.
+ *
+ * Link it in front of the MPI library, or preload it into an unmodified
+ * binary:
+ *
+ *   mpirun -np 4 env LD_PRELOAD=../mpiprof/libmpiprof.so ./heat
+ *
+ * Every rank counts messages, bytes and time spent in point-to-point calls,
+ * MPI_Sendrecv, MPI_Probe/MPI_Iprobe and MPI_Gatherv/MPI_Scatterv, per
+ * peer. Receive requests are followed through every Wait and Test variant
+ * and MPI_Request_free.
+ *
+ * The counters are plain per process statics. They assume MPI is called
+ * from one thread only, as under MPI_THREAD_FUNNELED or SERIALIZED; the
+ * worker threads of the programs here never call MPI. At MPI_Finalize the counters
+ * are gathered on rank 0, which prints a per-rank table, the load
+ * imbalance (max/avg time in MPI) and writes the rank x rank byte and
+ * message matrices, and the time blocked on each peer, to
+ * mpiprof_bytes.csv, mpiprof_msgs.csv and mpiprof_wait.csv (prefix set
+ * with MPIPROF_OUT).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+enum {
+    F_SEND, F_RECV, F_SENDRECV, F_ISEND, F_IRECV, F_WAIT, F_TEST, F_PROBE, F_GATHERV, F_SCATTERV, N_FUNCS
+};
+
+const char *func_name[N_FUNCS] = {
+    "Send", "Recv", "Sendrecv", "Isend", "Irecv", "Wait", "Test", "Probe", "Gatherv", "Scatterv"
+};
+
+/* Per rank counters, indexed by function */
+static double calls[N_FUNCS];
+static double bytes[N_FUNCS];
+static double seconds[N_FUNCS];
+
+/* Bytes and messages sent from this rank to every world rank, and time
+ * blocked in calls waiting on that rank */
+static double *peer_bytes;
+static double *peer_msgs;
+static double *peer_seconds;
+
+static int world_rank, world_size;
+static int initialized = 0;
+
+/* Cached world ranks for every communicator, stored as an attribute */
+static int translation_key = MPI_KEYVAL_INVALID;
+
+/* Outstanding receive requests, retired when a Wait or Test variant
+ * completes them or MPI_Request_free releases them */
+#define MAX_PENDING 1024
+static MPI_Request pending_req[MAX_PENDING];
+static MPI_Comm pending_comm[MAX_PENDING];
+static int n_pending = 0;
+static int pending_overflow = 0;
+
+
+static int free_translation(MPI_Comm comm, int key, void *value, void *extra){
+    free(value);
+    return MPI_SUCCESS;
+}
+
+static void setup(){
+    if(initialized){
+        return;
+    }
+    PMPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    PMPI_Comm_size(MPI_COMM_WORLD, &world_size);
+    peer_bytes = calloc(world_size, sizeof(double));
+    peer_msgs = calloc(world_size, sizeof(double));
+    peer_seconds = calloc(world_size, sizeof(double));
+    PMPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, free_translation, &translation_key, NULL);
+    initialized = 1;
+}
+
+/* World rank of rank r in comm */
+static int world_of(MPI_Comm comm, int r){
+    if(comm == MPI_COMM_WORLD || r < 0){
+        return r;
+    }
+    int *table;
+    int found;
+    PMPI_Comm_get_attr(comm, translation_key, &table, &found);
+    if(!found){
+        int size;
+        MPI_Group group, world_group;
+        PMPI_Comm_size(comm, &size);
+        PMPI_Comm_group(comm, &group);
+        PMPI_Comm_group(MPI_COMM_WORLD, &world_group);
+
+        int *ranks = malloc(size * sizeof(int));
+        table = malloc(size * sizeof(int));
+        for(int i = 0; i < size; i++){
+            ranks[i] = i;
+        }
+        PMPI_Group_translate_ranks(group, size, ranks, world_group, table);
+        free(ranks);
+        PMPI_Group_free(&group);
+        PMPI_Group_free(&world_group);
+        PMPI_Comm_set_attr(comm, translation_key, table);
+    }
+    return table[r];
+}
+
+static void count_send(MPI_Comm comm, int dest, double b){
+    int w = world_of(comm, dest);
+    if(w >= 0 && w < world_size){
+        peer_bytes[w] += b;
+        peer_msgs[w] += 1;
+    }
+}
+
+static void count_wait(MPI_Comm comm, int peer, double s){
+    int w = world_of(comm, peer);
+    if(w >= 0 && w < world_size){
+        peer_seconds[w] += s;
+    }
+}
+
+static double type_bytes(MPI_Datatype type, int count){
+    int size;
+    PMPI_Type_size(type, &size);
+    return (double)size * count;
+}
+
+static double status_bytes(MPI_Status *status){
+    int count;
+    PMPI_Get_count(status, MPI_BYTE, &count);
+    return count == MPI_UNDEFINED ? 0.0 : count;
+}
+
+
+int MPI_Init(int *argc, char ***argv){
+    int err = PMPI_Init(argc, argv);
+    setup();
+    return err;
+}
+
+int MPI_Init_thread(int *argc, char ***argv, int required, int *provided){
+    int err = PMPI_Init_thread(argc, argv, required, provided);
+    setup();
+    return err;
+}
+
+int MPI_Send(const void *buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm){
+    double t = PMPI_Wtime();
+    int err = PMPI_Send(buf, count, type, dest, tag, comm);
+    t = PMPI_Wtime() - t;
+    seconds[F_SEND] += t;
+    count_wait(comm, dest, t);
+
+    double b = type_bytes(type, count);
+    calls[F_SEND]++;
+    bytes[F_SEND] += b;
+    count_send(comm, dest, b);
+    return err;
+}
+
+int MPI_Recv(void *buf, int count, MPI_Datatype type, int source, int tag, MPI_Comm comm, MPI_Status *status){
+    MPI_Status local;
+    if(status == MPI_STATUS_IGNORE){
+        status = &local;
+    }
+    double t = PMPI_Wtime();
+    int err = PMPI_Recv(buf, count, type, source, tag, comm, status);
+    t = PMPI_Wtime() - t;
+    seconds[F_RECV] += t;
+    count_wait(comm, status->MPI_SOURCE, t);
+
+    calls[F_RECV]++;
+    bytes[F_RECV] += status_bytes(status);
+    return err;
+}
+
+/* The time is charged to the peer the receive came from, or to dest when
+ * the receive side is MPI_PROC_NULL */
+int MPI_Sendrecv(const void *sendbuf, int sendcount, MPI_Datatype sendtype, int dest, int sendtag,
+        void *recvbuf, int recvcount, MPI_Datatype recvtype, int source, int recvtag,
+        MPI_Comm comm, MPI_Status *status){
+    MPI_Status local;
+    if(status == MPI_STATUS_IGNORE){
+        status = &local;
+    }
+    double t = PMPI_Wtime();
+    int err = PMPI_Sendrecv(sendbuf, sendcount, sendtype, dest, sendtag,
+                            recvbuf, recvcount, recvtype, source, recvtag, comm, status);
+    t = PMPI_Wtime() - t;
+    seconds[F_SENDRECV] += t;
+    count_wait(comm, status->MPI_SOURCE >= 0 ? status->MPI_SOURCE : dest, t);
+
+    calls[F_SENDRECV]++;
+    if(dest != MPI_PROC_NULL){
+        double b = type_bytes(sendtype, sendcount);
+        bytes[F_SENDRECV] += b;
+        count_send(comm, dest, b);
+    }
+    return err;
+}
+
+/* Probes move no data, the time waiting is charged to the source found */
+int MPI_Probe(int source, int tag, MPI_Comm comm, MPI_Status *status){
+    MPI_Status local;
+    if(status == MPI_STATUS_IGNORE){
+        status = &local;
+    }
+    double t = PMPI_Wtime();
+    int err = PMPI_Probe(source, tag, comm, status);
+    t = PMPI_Wtime() - t;
+    seconds[F_PROBE] += t;
+    count_wait(comm, status->MPI_SOURCE, t);
+
+    calls[F_PROBE]++;
+    return err;
+}
+
+int MPI_Iprobe(int source, int tag, MPI_Comm comm, int *flag, MPI_Status *status){
+    MPI_Status local;
+    if(status == MPI_STATUS_IGNORE){
+        status = &local;
+    }
+    double t = PMPI_Wtime();
+    int err = PMPI_Iprobe(source, tag, comm, flag, status);
+    t = PMPI_Wtime() - t;
+    seconds[F_PROBE] += t;
+    if(*flag){
+        count_wait(comm, status->MPI_SOURCE, t);
+    }
+
+    calls[F_PROBE]++;
+    return err;
+}
+
+int MPI_Isend(const void *buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm, MPI_Request *request){
+    double t = PMPI_Wtime();
+    int err = PMPI_Isend(buf, count, type, dest, tag, comm, request);
+    seconds[F_ISEND] += PMPI_Wtime() - t;
+
+    double b = type_bytes(type, count);
+    calls[F_ISEND]++;
+    bytes[F_ISEND] += b;
+    count_send(comm, dest, b);
+    return err;
+}
+
+int MPI_Irecv(void *buf, int count, MPI_Datatype type, int source, int tag, MPI_Comm comm, MPI_Request *request){
+    double t = PMPI_Wtime();
+    int err = PMPI_Irecv(buf, count, type, source, tag, comm, request);
+    seconds[F_IRECV] += PMPI_Wtime() - t;
+
+    calls[F_IRECV]++;
+    if(n_pending < MAX_PENDING){
+        pending_req[n_pending] = *request;
+        pending_comm[n_pending] = comm;
+        n_pending++;
+    }
+    else if(!pending_overflow){
+        printf("mpiprof: rank %d has more than %d receives outstanding, "
+               "the bytes and waits of later ones are not counted\n", world_rank, MAX_PENDING);
+        pending_overflow = 1;
+    }
+    return err;
+}
+
+/* Index of req in the pending table, or -1 */
+static int find_pending(MPI_Request req){
+    for(int i = 0; i < n_pending; i++){
+        if(pending_req[i] == req){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void retire(int i){
+    pending_req[i] = pending_req[n_pending-1];
+    pending_comm[i] = pending_comm[n_pending-1];
+    n_pending--;
+}
+
+/* Received bytes are only known once a receive request completes */
+static void complete(MPI_Request req, MPI_Status *status, double t){
+    int i = find_pending(req);
+    if(i >= 0){
+        bytes[F_IRECV] += status_bytes(status);
+        count_wait(pending_comm[i], status->MPI_SOURCE, t);
+        retire(i);
+    }
+}
+
+/* The handles before the call, completed ones are reset to null by it */
+static MPI_Request *save_requests(int count, MPI_Request *requests){
+    MPI_Request *req = malloc((count > 0 ? count : 1) * sizeof(MPI_Request));
+    memcpy(req, requests, count * sizeof(MPI_Request));
+    return req;
+}
+
+/* Statuses to read from when the caller ignores them, NULL otherwise */
+static MPI_Status *local_statuses(int count, MPI_Status **statuses){
+    MPI_Status *local = NULL;
+    if(*statuses == MPI_STATUSES_IGNORE){
+        local = malloc((count > 0 ? count : 1) * sizeof(MPI_Status));
+        *statuses = local;
+    }
+    return local;
+}
+
+int MPI_Wait(MPI_Request *request, MPI_Status *status){
+    MPI_Status local;
+    if(status == MPI_STATUS_IGNORE){
+        status = &local;
+    }
+    MPI_Request req = *request;
+    double t = PMPI_Wtime();
+    int err = PMPI_Wait(request, status);
+    t = PMPI_Wtime() - t;
+    seconds[F_WAIT] += t;
+
+    calls[F_WAIT]++;
+    complete(req, status, t);
+    return err;
+}
+
+int MPI_Waitall(int count, MPI_Request *requests, MPI_Status *statuses){
+    MPI_Request *req = save_requests(count, requests);
+    MPI_Status *local = local_statuses(count, &statuses);
+    double t = PMPI_Wtime();
+    int err = PMPI_Waitall(count, requests, statuses);
+    seconds[F_WAIT] += PMPI_Wtime() - t;
+
+    /* Time in a Waitall cannot be split between peers */
+    calls[F_WAIT]++;
+    for(int i = 0; i < count; i++){
+        complete(req[i], &statuses[i], 0.0);
+    }
+    free(req);
+    free(local);
+    return err;
+}
+
+int MPI_Waitany(int count, MPI_Request *requests, int *index, MPI_Status *status){
+    MPI_Status local;
+    if(status == MPI_STATUS_IGNORE){
+        status = &local;
+    }
+    MPI_Request *req = save_requests(count, requests);
+    double t = PMPI_Wtime();
+    int err = PMPI_Waitany(count, requests, index, status);
+    t = PMPI_Wtime() - t;
+    seconds[F_WAIT] += t;
+
+    calls[F_WAIT]++;
+    if(*index != MPI_UNDEFINED){
+        complete(req[*index], status, t);
+    }
+    free(req);
+    return err;
+}
+
+int MPI_Waitsome(int incount, MPI_Request *requests, int *outcount, int *indices, MPI_Status *statuses){
+    MPI_Request *req = save_requests(incount, requests);
+    MPI_Status *local = local_statuses(incount, &statuses);
+    double t = PMPI_Wtime();
+    int err = PMPI_Waitsome(incount, requests, outcount, indices, statuses);
+    seconds[F_WAIT] += PMPI_Wtime() - t;
+
+    /* As in Waitall the time is not split between peers */
+    calls[F_WAIT]++;
+    for(int i = 0; *outcount != MPI_UNDEFINED && i < *outcount; i++){
+        complete(req[indices[i]], &statuses[i], 0.0);
+    }
+    free(req);
+    free(local);
+    return err;
+}
+
+/* Tests poll instead of blocking, their time is not charged to a peer */
+int MPI_Test(MPI_Request *request, int *flag, MPI_Status *status){
+    MPI_Status local;
+    if(status == MPI_STATUS_IGNORE){
+        status = &local;
+    }
+    MPI_Request req = *request;
+    double t = PMPI_Wtime();
+    int err = PMPI_Test(request, flag, status);
+    seconds[F_TEST] += PMPI_Wtime() - t;
+
+    calls[F_TEST]++;
+    if(*flag){
+        complete(req, status, 0.0);
+    }
+    return err;
+}
+
+int MPI_Testany(int count, MPI_Request *requests, int *index, int *flag, MPI_Status *status){
+    MPI_Status local;
+    if(status == MPI_STATUS_IGNORE){
+        status = &local;
+    }
+    MPI_Request *req = save_requests(count, requests);
+    double t = PMPI_Wtime();
+    int err = PMPI_Testany(count, requests, index, flag, status);
+    seconds[F_TEST] += PMPI_Wtime() - t;
+
+    calls[F_TEST]++;
+    if(*flag && *index != MPI_UNDEFINED){
+        complete(req[*index], status, 0.0);
+    }
+    free(req);
+    return err;
+}
+
+int MPI_Testall(int count, MPI_Request *requests, int *flag, MPI_Status *statuses){
+    MPI_Request *req = save_requests(count, requests);
+    MPI_Status *local = local_statuses(count, &statuses);
+    double t = PMPI_Wtime();
+    int err = PMPI_Testall(count, requests, flag, statuses);
+    seconds[F_TEST] += PMPI_Wtime() - t;
+
+    calls[F_TEST]++;
+    for(int i = 0; *flag && i < count; i++){
+        complete(req[i], &statuses[i], 0.0);
+    }
+    free(req);
+    free(local);
+    return err;
+}
+
+int MPI_Testsome(int incount, MPI_Request *requests, int *outcount, int *indices, MPI_Status *statuses){
+    MPI_Request *req = save_requests(incount, requests);
+    MPI_Status *local = local_statuses(incount, &statuses);
+    double t = PMPI_Wtime();
+    int err = PMPI_Testsome(incount, requests, outcount, indices, statuses);
+    seconds[F_TEST] += PMPI_Wtime() - t;
+
+    calls[F_TEST]++;
+    for(int i = 0; *outcount != MPI_UNDEFINED && i < *outcount; i++){
+        complete(req[indices[i]], &statuses[i], 0.0);
+    }
+    free(req);
+    free(local);
+    return err;
+}
+
+/* A freed receive still completes, but nothing can report it any more */
+int MPI_Request_free(MPI_Request *request){
+    int i = find_pending(*request);
+    if(i >= 0){
+        retire(i);
+    }
+    return PMPI_Request_free(request);
+}
+
+int MPI_Gatherv(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+        void *recvbuf, const int *recvcounts, const int *displs, MPI_Datatype recvtype,
+        int root, MPI_Comm comm){
+    double t = PMPI_Wtime();
+    int err = PMPI_Gatherv(sendbuf, sendcount, sendtype, recvbuf, recvcounts, displs, recvtype, root, comm);
+    seconds[F_GATHERV] += PMPI_Wtime() - t;
+
+    int rank;
+    PMPI_Comm_rank(comm, &rank);
+    calls[F_GATHERV]++;
+    if(rank != root){
+        double b = type_bytes(sendtype, sendcount);
+        bytes[F_GATHERV] += b;
+        count_send(comm, root, b);
+    }
+    return err;
+}
+
+int MPI_Scatterv(const void *sendbuf, const int *sendcounts, const int *displs, MPI_Datatype sendtype,
+        void *recvbuf, int recvcount, MPI_Datatype recvtype, int root, MPI_Comm comm){
+    double t = PMPI_Wtime();
+    int err = PMPI_Scatterv(sendbuf, sendcounts, displs, sendtype, recvbuf, recvcount, recvtype, root, comm);
+    seconds[F_SCATTERV] += PMPI_Wtime() - t;
+
+    int rank, size;
+    PMPI_Comm_rank(comm, &rank);
+    PMPI_Comm_size(comm, &size);
+    calls[F_SCATTERV]++;
+    if(rank == root){
+        for(int i = 0; i < size; i++){
+            if(i != root){
+                double b = type_bytes(sendtype, sendcounts[i]);
+                bytes[F_SCATTERV] += b;
+                count_send(comm, i, b);
+            }
+        }
+    }
+    return err;
+}
+
+
+static void write_matrix(const char *prefix, const char *what, double *matrix){
+    char name[256];
+    snprintf(name, sizeof(name), "%s_%s.csv", prefix, what);
+    FILE *f = fopen(name, "w");
+    if(!f){
+        printf("mpiprof: error writing %s\n", name);
+        return;
+    }
+    fprintf(f, "from\\to");
+    for(int j = 0; j < world_size; j++){
+        fprintf(f, ",%d", j);
+    }
+    fprintf(f, "\n");
+    for(int i = 0; i < world_size; i++){
+        fprintf(f, "%d", i);
+        for(int j = 0; j < world_size; j++){
+            fprintf(f, ",%.0f", matrix[i*world_size + j]);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+static void report(){
+    /* Everything a rank knows, in one contiguous record */
+    int record = 3*N_FUNCS + 3*world_size;
+    double *mine = malloc(record * sizeof(double));
+    for(int f = 0; f < N_FUNCS; f++){
+        mine[f] = calls[f];
+        mine[N_FUNCS + f] = bytes[f];
+        mine[2*N_FUNCS + f] = seconds[f];
+    }
+    memcpy(&mine[3*N_FUNCS], peer_bytes, world_size * sizeof(double));
+    memcpy(&mine[3*N_FUNCS + world_size], peer_msgs, world_size * sizeof(double));
+    memcpy(&mine[3*N_FUNCS + 2*world_size], peer_seconds, world_size * sizeof(double));
+
+    double *all = NULL;
+    if(world_rank == 0){
+        all = malloc((size_t)record * world_size * sizeof(double));
+    }
+    PMPI_Gather(mine, record, MPI_DOUBLE, all, record, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    free(mine);
+
+    if(world_rank != 0){
+        return;
+    }
+
+    printf("\nmpiprof: time in MPI per rank [s]\n");
+    printf("%5s", "rank");
+    for(int f = 0; f < N_FUNCS; f++){
+        printf(" %10s", func_name[f]);
+    }
+    printf(" %10s %12s %8s\n", "total", "sent bytes", "msgs");
+
+    double max_time = 0, sum_time = 0;
+    double func_max[N_FUNCS] = {0}, func_sum[N_FUNCS] = {0};
+    double *byte_matrix = malloc((size_t)world_size * world_size * sizeof(double));
+    double *msg_matrix = malloc((size_t)world_size * world_size * sizeof(double));
+    double *wait_matrix = malloc((size_t)world_size * world_size * sizeof(double));
+
+    for(int r = 0; r < world_size; r++){
+        double *rec = &all[(size_t)r * record];
+        double total = 0, sent = 0, msgs = 0;
+        printf("%5d", r);
+        for(int f = 0; f < N_FUNCS; f++){
+            double s = rec[2*N_FUNCS + f];
+            printf(" %10.4f", s);
+            total += s;
+            func_sum[f] += s;
+            if(s > func_max[f]){
+                func_max[f] = s;
+            }
+        }
+        for(int j = 0; j < world_size; j++){
+            byte_matrix[r*world_size + j] = rec[3*N_FUNCS + j];
+            msg_matrix[r*world_size + j] = rec[3*N_FUNCS + world_size + j];
+            wait_matrix[r*world_size + j] = rec[3*N_FUNCS + 2*world_size + j];
+            sent += rec[3*N_FUNCS + j];
+            msgs += rec[3*N_FUNCS + world_size + j];
+        }
+        printf(" %10.4f %12.0f %8.0f\n", total, sent, msgs);
+        sum_time += total;
+        if(total > max_time){
+            max_time = total;
+        }
+    }
+
+    printf("\nmpiprof: load imbalance (max/avg time)\n");
+    for(int f = 0; f < N_FUNCS; f++){
+        if(func_sum[f] > 0){
+            printf("  %-10s %6.2f\n", func_name[f], func_max[f] / (func_sum[f] / world_size));
+        }
+    }
+    if(sum_time > 0){
+        printf("  %-10s %6.2f\n", "total", max_time / (sum_time / world_size));
+    }
+
+    /* Small runs fit on screen, larger ones are only written to file */
+    if(world_size <= 16){
+        printf("\nmpiprof: bytes sent (row = from, column = to)\n");
+        for(int i = 0; i < world_size; i++){
+            for(int j = 0; j < world_size; j++){
+                printf(" %10.0f", byte_matrix[i*world_size + j]);
+            }
+            printf("\n");
+        }
+    }
+
+    const char *prefix = getenv("MPIPROF_OUT");
+    if(!prefix){
+        prefix = "mpiprof";
+    }
+    write_matrix(prefix, "bytes", byte_matrix);
+    write_matrix(prefix, "msgs", msg_matrix);
+    write_matrix(prefix, "wait", wait_matrix);
+    printf("\nmpiprof: wrote %s_bytes.csv, %s_msgs.csv and %s_wait.csv\n", prefix, prefix, prefix);
+    fflush(stdout);
+
+    free(byte_matrix);
+    free(msg_matrix);
+    free(wait_matrix);
+    free(all);
+}
+
+int MPI_Finalize(){
+    setup();
+    report();
+    free(peer_bytes);
+    free(peer_msgs);
+    free(peer_seconds);
+    return PMPI_Finalize();
+}